@@ -1,306 +1,4387 @@
 // --- LIBRARIES ---
+// HAL_HOST=1 builds the control logic without the board, for the simulator in
+// host/: it supplies the hal*() functions, the gsm and console streams, and
+// hal_host.h stands in for the Arduino core and AVR libraries.
+#ifndef HAL_HOST
+#define HAL_HOST 0
+#endif
+// Board targets. The control logic is the same on every board; the board is
+// picked from the compiler's target and only the HAL section differs.
+#define BOARD_UNO 0                 // ATmega328P: Uno, Nano
+#define BOARD_MEGA 1                // ATmega2560: spare hardware UARTs, 8 KB SRAM
+#define BOARD_ESP32 2               // Two cores: radio on one, sensing and actuation on the other
+#if defined(ARDUINO_ARCH_ESP32)
+#define BOARD BOARD_ESP32
+#define HAL_CORES 2
+#elif defined(__AVR_ATmega2560__) || defined(__AVR_ATmega1280__)
+#define BOARD BOARD_MEGA
+#define HAL_CORES 1
+#else
+#define BOARD BOARD_UNO
+#define HAL_CORES 1
+#endif
+#if HAL_HOST
+#include "hal_host.h"
+#elif BOARD == BOARD_ESP32
+#include <Wire.h>
+#include <LiquidCrystal_I2C.h>
+#include <EEPROM.h>
+#include <esp_system.h>
+#else
 #include <Wire.h>
 #include <LiquidCrystal_I2C.h>
 #include <Servo.h>
-#include <DHT.h>
-#include <SoftwareSerial.h>
+#include <EEPROM.h>
+#include <avr/sleep.h>
+#include <avr/power.h>
+#include <avr/wdt.h>
+#endif
+#if HAL_HOST
+// PRI_PSTR, HAL_ISR_ATTR, HAL_NOINIT and ATOMIC_BLOCK() come from hal_host.h
+#elif BOARD == BOARD_ESP32
+// What the AVR headers provide, for two cores. One spinlock stands in for
+// turning interrupts off, so ATOMIC_BLOCK() also excludes the other core.
+portMUX_TYPE halAtomicLock = portMUX_INITIALIZER_UNLOCKED;
+struct AtomicGuard {
+    AtomicGuard() { portENTER_CRITICAL_SAFE(&halAtomicLock); }
+    ~AtomicGuard() { portEXIT_CRITICAL_SAFE(&halAtomicLock); } // Also on return from inside the block
+};
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_BLOCK(type) for (AtomicGuard atomicGuard, *atomicOnce = &atomicGuard; atomicOnce; atomicOnce = NULL)
+#define E2END 1023                  // EEPROM emulated in flash, same layout as the Uno
+#define PRI_PSTR "%s"               // printf conversion for a PSTR() argument; flash is addressable
+#define HAL_ISR_ATTR IRAM_ATTR      // Runs while flash writes have the cache disabled
+#define HAL_NOINIT RTC_NOINIT_ATTR  // Survives software and watchdog resets
+// The core's std::min and std::max want both arguments of one type; the logic
+// relies on the promotions of the AVR macros
+#define min(a, b) _min(a, b)
+#define max(a, b) _max(a, b)
+#else
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#define PRI_PSTR "%S"
+#define HAL_ISR_ATTR
+#define HAL_NOINIT __attribute__((section(".noinit"))) // Not cleared by the startup code
+#endif
 
 // --- SENSOR & ACTUATOR PINS ---
+#if BOARD == BOARD_ESP32
+#define DHT_PIN 4
+#define SOIL_SENSOR_PIN 34          // ADC1: ADC2 is unavailable while the radio is on
+#define SOUND_SENSOR_PIN 27
+#define FAN_RELAY_PIN 26            // Relay (active low), or MOSFET gate with FAN_PWM (LEDC)
+#define SERVO_PIN 13                // LEDC at 50 Hz
+#define BUZZER_PIN 25
+#define GSM_RX_PIN 16               // Serial1, remapped
+#define GSM_TX_PIN 17
+#else
 #define DHT_PIN 2
 #define SOIL_SENSOR_PIN A0
 #define SOUND_SENSOR_PIN 7
-#define FAN_RELAY_PIN 3
+#define FAN_RELAY_PIN 3             // Relay (active low), or MOSFET gate with FAN_PWM: must be OC2B
 #define SERVO_PIN 5
 #define BUZZER_PIN 4
 #define GSM_RX_PIN 10
 #define GSM_TX_PIN 11
+#endif
+
+// --- BUILD OPTIONS ---
+// Where the GSM modem is wired. SoftwareSerial bit-bangs every byte with
+// interrupts off; a hardware UART buffers both directions from interrupts.
+#define GSM_PORT_SOFTWARE 0         // GSM_RX_PIN / GSM_TX_PIN, AVR boards
+#define GSM_PORT_SERIAL1 1          // Serial1: TX1/RX1 on the Mega, GSM_RX_PIN / GSM_TX_PIN on the ESP32
+#define GSM_PORT_SERIAL 2           // Serial (pins 0/1) on AVR boards; console output is discarded
+#if BOARD == BOARD_UNO
+#define GSM_PORT GSM_PORT_SOFTWARE
+#else
+#define GSM_PORT GSM_PORT_SERIAL1   // A spare hardware UART
+#endif
+#if BOARD == BOARD_ESP32 && GSM_PORT != GSM_PORT_SERIAL1 && !HAL_HOST
+#error "On the ESP32 the modem goes on Serial1"
+#endif
+#if GSM_PORT == GSM_PORT_SOFTWARE && !HAL_HOST
+#include <SoftwareSerial.h>
+#endif
+#define FAN_PWM 0                   // 1 = MOSFET fan with speed proportional to temperature
+#ifndef ENABLE_PROFILING
+#define ENABLE_PROFILING 0          // 1 = collect per-task timing and SRAM statistics
+#endif
+#ifndef ENABLE_TELEMETRY
+#define ENABLE_TELEMETRY 0          // 1 = batch sensor samples to an MQTT broker over GPRS
+                                    // (set TELEMETRY_APN and TELEMETRY_BROKER first; on an
+                                    // Uno it costs ~180 bytes of the 2 KB SRAM)
+#endif
+#define PROFILE_REPORT_INTERVAL 0   // ms between automatic reports, 0 = only on PROF command
 
 // --- CONSTANTS ---
-#define DHT_TYPE DHT11
 #define LCD_ADDRESS 0x27
+// Factory defaults for the tunable settings, used until a valid config block
+// has been saved to EEPROM (see CONFIG)
 #define TEMPERATURE_THRESHOLD 30.0  // Temp in Celsius to turn on the fan
-#define WETNESS_THRESHOLD 500       // Analog value from soil sensor indicating wetness
-#define CRADLE_SWING_SPEED 30       // Milliseconds between servo position updates
+#define FAN_HYSTERESIS 1.0          // Fan turns off again this far below the threshold
+#define CRITICAL_TEMPERATURE 35.0   // Heat index in Celsius that raises a critical alert
+#define WETNESS_THRESHOLD 500       // Filtered soil value below which the diaper is wet
+#define DRYNESS_THRESHOLD 560       // Filtered soil value above which it counts as dry again
+#define CRADLE_SWING_SPEED 30       // Milliseconds per degree of travel at the default swing
 #define CRADLE_POS_REST 60
 #define CRADLE_POS_MIN 30
 #define CRADLE_POS_MAX 90
-const char* PARENT_PHONE_NUMBER = "+917416640739"; // Phone number for SMS alerts
+#define CRADLE_SWING_CYCLES 3       // Cycles of a SWING command
+#define SOOTHE_QUIET_TIME 20        // Seconds without crying before soothing winds down
+const char PARENT_PHONE_NUMBER[] PROGMEM = "+917416640739"; // Phone number for SMS alerts
+// Telemetry uplink (ENABLE_TELEMETRY)
+const char TELEMETRY_APN[] PROGMEM = "internet";                  // Carrier APN for GPRS
+const char TELEMETRY_BROKER[] PROGMEM = "mqtt.example.com";       // MQTT broker host
+#define TELEMETRY_BROKER_PORT 1883
+const char TELEMETRY_CLIENT_ID[] PROGMEM = "babymonitor-cradle1";
+const char TELEMETRY_TOPIC[] PROGMEM = "babymonitor/cradle1/telemetry";
+
+// --- MESSAGE TABLE ---
+// Every fixed text lives in flash and is referred to by ID. The LCD renderer,
+// the serial log and the SMS composer stream it out of PROGMEM without a RAM copy.
+#define MESSAGES(X) \
+    X(MSG_LCD_SPLASH,        " Baby Monitor ") \
+    X(MSG_LCD_SWINGING,      "Cradle Swinging") \
+    X(MSG_LCD_WET,           "Diaper is Wet!") \
+    X(MSG_LCD_OK,            "System OK") \
+    X(MSG_LCD_SELFTEST,      "Self-test...") \
+    X(MSG_LCD_CHECK,         "Check sensors!") \
+    X(MSG_LCD_HOT,           "Room Too Hot!") \
+    X(MSG_LCD_FAN_ON,        "F:ON ") \
+    X(MSG_LCD_FAN_OFF,       "F:OFF") \
+    X(MSG_LCD_NO_READING,    "--.-") \
+    X(MSG_SMS_CRY,           "Alert: Baby is Crying!") \
+    X(MSG_SMS_HEAT,          "URGENT: Baby's room is dangerously hot!") \
+    X(MSG_SMS_WET,           "Alert: Diaper is wet. Please check.") \
+    X(MSG_SMS_REPLY,         "Cradle: ") \
+    X(MSG_REPLY_SWINGING,    "swinging.") \
+    X(MSG_REPLY_FAN_ON,      "fan forced on for 1 h.") \
+    X(MSG_REPLY_FAN_OFF,     "fan forced off for 1 h.") \
+    X(MSG_REPLY_FAN_AUTO,    "fan on automatic.") \
+    X(MSG_REPLY_MUTED,       "buzzer muted for 30 min.") \
+    X(MSG_REPLY_ACK,         "alert acknowledged, escalation stopped.") \
+    X(MSG_REPLY_NO_ALERT,    "no alert waiting for an ACK.") \
+    X(MSG_SYSTEM_READY,      "System Ready.") \
+    X(MSG_CRY_ALERT,         "Baby Crying! Starting cradle and alert.") \
+    X(MSG_WET_ALERT,         "Baby Urinated! Starting alert.") \
+    X(MSG_DIAPER_DRY,        "Diaper is dry again.") \
+    X(MSG_HEAT_ALERT,        "Room too hot! Starting critical alert.") \
+    X(MSG_HEAT_OK,           "Room temperature back to normal.") \
+    X(MSG_CRADLE_STOPPED,    "Cradle stopped.") \
+    X(MSG_CRY_STOPPED,       "Crying stopped.") \
+    X(MSG_BABY_SETTLED,      "Baby settled, cradle winding down.") \
+    X(MSG_DHT_TIMEOUT,       "DHT read timed out.") \
+    X(MSG_DHT_CHECKSUM,      "DHT checksum error.") \
+    X(MSG_NO_TREND,          "no trend data yet.") \
+    X(MSG_SELFTEST_PASSED,   "Self-test passed.") \
+    X(MSG_SELFTEST_FAILED,   "Self-test failed: ") \
+    X(MSG_CALIBRATING,       "Calibrating: keep the diaper dry and the room quiet.") \
+    X(MSG_SOIL_CALIBRATED,   "Soil probe calibrated, dry level ") \
+    X(MSG_SOIL_SKIPPED,      "Soil probe reads wet, calibration skipped.") \
+    X(MSG_SOUND_CALIBRATED,  "Sound noise floor calibrated: ") \
+    X(MSG_SOUND_SKIPPED,     "Room too loud, sound calibration skipped.") \
+    X(MSG_UNKNOWN_COMMAND,   "Unknown command: ") \
+    X(MSG_QUEUE_FULL,        "Alert queue full, lowest priority alert dropped.") \
+    X(MSG_CALLING,           "Calling ") \
+    X(MSG_CALL_ENDED,        "Call ended.") \
+    X(MSG_CALL_FAILED,       "Call failed!") \
+    X(MSG_ESCALATING,        "No ACK, escalating to ") \
+    X(MSG_ESCALATION_DONE,   "No ACK from any number, escalation ended.") \
+    X(MSG_GSM_BUSY,          "GSM busy, SMS dropped.") \
+    X(MSG_SMS_SENDING,       "Sending SMS to ") \
+    X(MSG_SMS_SENT,          "SMS Sent!") \
+    X(MSG_SMS_FAILED,        "SMS Failed!") \
+    X(MSG_SMS_DROPPED,       "SMS refused too often, alert dropped.") \
+    X(MSG_SMS_RECEIVED,      "SMS received at index ") \
+    X(MSG_SMS_COMMAND,       "SMS command: ") \
+    X(MSG_SMS_IGNORED,       "SMS from unknown sender ignored: ") \
+    X(MSG_INBOX_FULL,        "SMS inbox full, message left on SIM.") \
+    X(MSG_SIM_CLEARED,       "Stored SMS deleted from SIM.") \
+    X(MSG_GSM_INIT,          "Initializing GSM Module...") \
+    X(MSG_GSM_READY,         "GSM Module Initialized Successfully!") \
+    X(MSG_GSM_RETRY,         "Retrying GSM Connection...") \
+    X(MSG_GSM_FAILED,        "GSM Module Initialization Failed!") \
+    X(MSG_LAST_RESET,        "Last reset: ") \
+    X(MSG_LCD_FAULT,         "LCD not responding, display paused.") \
+    X(MSG_LCD_RECOVERED,     "LCD recovered.") \
+    X(MSG_CONFIG_DEFAULTS,   "No valid config in EEPROM, using defaults.") \
+    X(MSG_CONFIG_UPDATED,    "Config updated.") \
+    X(MSG_CONFIG_INVALID,    "Invalid setting: ") \
+    X(MSG_LINK_UP,           "Telemetry link up.") \
+    X(MSG_LINK_FAILED,       "Telemetry link failed.") \
+    X(MSG_FRAME_DROPPED,     "Telemetry buffer full, oldest samples dropped.")
+
+#define MESSAGE_ID(id, text) id,
+enum MessageId { MESSAGES(MESSAGE_ID) MSG_COUNT };
+#define MESSAGE_TEXT(id, text) const char id##_TEXT[] PROGMEM = text;
+MESSAGES(MESSAGE_TEXT)
+#define MESSAGE_ENTRY(id, text) id##_TEXT,
+const char* const MESSAGE_TABLE[MSG_COUNT] PROGMEM = { MESSAGES(MESSAGE_ENTRY) };
 
 // --- OBJECT INITIALIZATION ---
-DHT dht(DHT_PIN, DHT_TYPE);
-Servo cradleServo;
+#if HAL_HOST
+extern Stream& gsmPort;  // Simulated modem, provided by the host build
+extern Stream& console;
+#else
+#if BOARD != BOARD_ESP32
+Servo cradleServo;                  // The ESP32 drives the servo from LEDC instead
+#endif
 LiquidCrystal_I2C lcd(LCD_ADDRESS, 16, 2);
-SoftwareSerial gsm(GSM_RX_PIN, GSM_TX_PIN);
+#endif
+
+#if GSM_PORT == GSM_PORT_SOFTWARE
+// SoftwareSerial sends each byte with interrupts off, ~1 ms at GSM_BAUD, so a
+// whole command written in one pass would stall the tick and the DHT edges for
+// tens of ms. Writes are queued here instead and manageGSM() sends GSM_TX_CHUNK
+// of them per pass.
+#define GSM_TX_QUEUE_SIZE 48        // AT+CIPSTART, the longest command, fits whole
+#define GSM_TX_CHUNK 2              // Bytes sent per pass: ~2 ms, inside taskGSM's budget
+class GsmTxQueue : public Stream {
+public:
+    explicit GsmTxQueue(Stream& port) : port(port), head(0), count(0) {}
+    size_t write(uint8_t c) {
+        if (count == GSM_TX_QUEUE_SIZE) send(1); // Full: block for one byte rather than drop it
+        queue[(head + count) % GSM_TX_QUEUE_SIZE] = c;
+        count++;
+        return 1;
+    }
+    int availableForWrite() { return GSM_TX_QUEUE_SIZE - count; }
+    int available() { return port.available(); }
+    int read() { return port.read(); }
+    int peek() { return port.peek(); }
+    void flush() {
+        send(count);
+        port.flush();
+    }
+    // Sends up to limit queued bytes, oldest first
+    void send(byte limit) {
+        for (; limit > 0 && count > 0; limit--) {
+            port.write(queue[head]);
+            head = (head + 1) % GSM_TX_QUEUE_SIZE;
+            count--;
+        }
+    }
+
+private:
+    Stream& port;
+    byte queue[GSM_TX_QUEUE_SIZE];
+    byte head;
+    byte count;
+};
+#endif
+
+#if HAL_HOST
+// The console comes from the host build
+#if GSM_PORT == GSM_PORT_SOFTWARE
+GsmTxQueue gsm(gsmPort);
+#else
+#define gsm gsmPort
+#endif
+#elif GSM_PORT == GSM_PORT_SOFTWARE
+SoftwareSerial gsmPort(GSM_RX_PIN, GSM_TX_PIN);
+GsmTxQueue gsm(gsmPort);
+Stream& console = Serial;
+#elif GSM_PORT == GSM_PORT_SERIAL1
+#define gsm Serial1
+#define gsmPort Serial1
+Stream& console = Serial;
+#else
+// The modem owns the only UART, so console output goes nowhere. Disconnect
+// the modem from pins 0/1 to upload.
+class NullStream : public Stream {
+public:
+    size_t write(uint8_t) { return 1; }
+    int availableForWrite() { return SERIAL_TX_BUFFER_SIZE; }
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    void flush() {}
+};
+NullStream nullConsole;
+#define gsm Serial
+#define gsmPort Serial
+Stream& console = nullConsole;
+#endif
 
 // --- GLOBAL VARIABLES for State Management ---
-unsigned long lastSensorReadTime = 0;
-unsigned long lastLcdUpdateTime = 0;
+// Tunable settings: loaded from EEPROM once at boot and read straight from RAM
+// afterwards. A change bumps the CRC and is written back in the background.
+#define CONFIG_VERSION 5
+#define CONFIG_ADDRESS 0            // The event log lives at the top of the EEPROM
+#define CALIBRATED_SOIL 1           // Config.calibrated: wet/dry thresholds fit this unit's probe...
+#define CALIBRATED_SOUND 2          // ...and soundFloor its room
+#define PHONE_NUMBER_LENGTH 16
+#define ALERT_RECIPIENTS 3          // Primary number, then the escalation order
+struct Config {
+    byte version;
+    float temperatureThreshold;     // C, fan on above
+    float fanHysteresis;            // C, fan off below temperatureThreshold minus this
+    float criticalTemperature;      // C heat index, critical alert above
+    int wetnessThreshold;           // Filtered soil value, wet below
+    int drynessThreshold;           // Filtered soil value, dry again above
+    byte soundFloor;                // Background sound level (ms of the window); raises the cry limit
+    byte calibrated;                // CALIBRATED_ bits; the self-test calibrates what is missing
+    byte swingSpeed;                // ms per degree of travel
+    byte posRest;                   // Servo degrees
+    byte posMin;
+    byte posMax;
+    byte swingCycles;
+    byte quietTime;                 // s of quiet before the soothing swing winds down
+    char phoneNumbers[ALERT_RECIPIENTS][PHONE_NUMBER_LENGTH]; // [0] primary, "" if unused
+    uint16_t crc;                   // CRC-16 of everything above
+} __attribute__((packed));
+Config config;
+Config configWriteBuffer;           // Snapshot being written, so later edits can't tear it
+bool configDirty = false;
+
+
+// DHT11 reader: the task sends the start pulse, INT0 timestamps the sensor's
+// falling edges and decodes bits from their spacing, with interrupts left on.
+// One transfer carries both humidity and temperature.
+#define DHT_READ_INTERVAL 2000      // DHT11 gives new data at most every 1-2 s
+#define DHT_START_PULSE 20          // Host start signal, must be >= 18 ms low
+#define DHT_RESPONSE_TIMEOUT 10     // A full transfer takes about 5 ms
+#define DHT_BIT_THRESHOLD 100       // us between falling edges: ~78 for a 0, ~120 for a 1
+#define DHT_EDGE_COUNT 42           // Response + preamble edges, then one per data bit
+#define DHT_STALE_TIME 10000        // Cached reading is shown as unknown after this
+enum DhtState { DHT_IDLE, DHT_START, DHT_RECEIVING };
+DhtState dhtState = DHT_IDLE;
+unsigned long dhtStateStartTime = 0;
+volatile byte dhtEdgeCount = 0;
+volatile byte dhtData[5];
+volatile unsigned long dhtLastEdgeTime = 0;
+float lastTemperature = NAN;        // Last valid reading...
+float lastHumidity = NAN;           // ...relative humidity from the same transfer...
+float lastHeatIndex = NAN;          // ...the apparent temperature computed from both...
+unsigned long lastTemperatureTime = 0; // ...and when it was taken
+#define LCD_PAGE_TIME 3000          // Lines alternate reading / heat index, status / trend this often
 
-// Diaper alert state
+// Cry detection: the sound sensor is sampled at 1 kHz from the Timer2 tick into
+// a ring of 10 ms bins, and a sliding window over the bins decides on crying.
+#define SOUND_ACTIVE LOW        // Sound module output level while it hears sound
+#define CRY_BIN_MS 10           // Samples per bin (1 sample per ms)
+#define CRY_WINDOW_BINS 30      // Sliding window of 300 ms
+#define CRY_MIN_EDGES 4         // Sound onsets in the window that mean crying...
+#define CRY_MIN_ACTIVE_MS 120   // ...or this much active time in the window
+#define CRY_QUIET_TIME 2000     // Crying has stopped after this long below both limits
+struct SoundBin {
+    byte edges;    // Inactive-to-active transitions
+    byte activeMs; // Samples with sound present
+};
+volatile SoundBin soundBins[CRY_WINDOW_BINS];
+volatile unsigned int windowEdges = 0;    // Sums over soundBins, kept by the ISR
+volatile unsigned int windowActiveMs = 0;
+byte soundBinIndex = 0;                   // ISR-only state
+byte soundBinTicks = 0;
+SoundBin currentSoundBin = { 0, 0 };
+bool wasSoundActive = false;
+bool isCrying = false;
+unsigned long lastCryActivityTime = 0;
+
+// Soil acquisition: the ADC free-runs on Timer0 overflows (~1 kHz), the ISR
+// averages blocks of SOIL_OVERSAMPLE readings and feeds them to an IIR filter.
+#define SOIL_OVERSAMPLE 64          // Readings per decimated sample (~15 Hz out)
+#define SOIL_FILTER_SHIFT 3         // IIR weight of 1/8 per decimated sample
+volatile unsigned int soilFilterState = 0; // Filtered value << SOIL_FILTER_SHIFT
+volatile bool soilFilterReady = false;
+unsigned int soilSampleSum = 0;            // ISR-only state
+byte soilSampleCount = 0;
+
+// Diaper alert state: latched while the filtered reading stays wet
 bool isDiaperAlertActive = false;
-unsigned long diaperAlertStartTime = 0;
+// Overheating: latched while the heat index stays above the critical threshold
+#define HEAT_ALERT_HYSTERESIS 1.0   // Clears this far below config.criticalTemperature
+bool isOverheated = false;
+// Fan controller: on/off with hysteresis and a minimum dwell in each state, plus
+// proportional speed when FAN_PWM is set. Its own state is the source of truth.
+#define FAN_MIN_DWELL 60000UL       // ms the fan stays on or off before it may switch again
+#define FAN_PWM_MIN_DUTY 40         // % duty at the on threshold; lower stalls most fans
+#define FAN_PWM_FULL_SPAN 5.0       // C above the threshold where the fan reaches 100 %
+bool isFanOn = false;
+byte fanDuty = 0;                   // % of full speed, 0 when off
+unsigned long fanSwitchTime = 0UL - FAN_MIN_DWELL; // millis() of the last on/off change; free to switch at boot
+#define FAN_OVERRIDE_TIME 3600000UL // A FAN ON/OFF command lasts an hour
+enum FanOverride { FAN_AUTO, FAN_FORCED_ON, FAN_FORCED_OFF };
+FanOverride fanOverride = FAN_AUTO;
+unsigned long fanOverrideTime = 0;
 
-// Cradle swing state
-enum CradleState { IDLE, SWINGING_FORWARD, SWINGING_BACK, RETURNING };
-CradleState cradleState = IDLE;
-unsigned long lastSwingTime = 0;
-int swingCycles = 0;
+// Cradle swing state: the Timer2 tick moves the servo along a sine profile.
+// Amplitude is 8.8 fixed point degrees and ramps, so swings start and stop smoothly.
+#define SERVO_UPDATE_MS 20          // Servo position update interval (its refresh rate)
+#define MOTION_RAMP_STEP ((30U * 256 * SERVO_UPDATE_MS) / 1000) // Ramp amplitude at 30 deg/s
+#define MOTION_MIN_PERIOD (4UL * SERVO_UPDATE_MS)     // At least four servo updates per cycle...
+#define MOTION_MAX_PERIOD (65535UL * SERVO_UPDATE_MS) // ...and a phase step of at least 1
+volatile bool motionActive = false;
+volatile bool motionStopped = false;        // Set by the ISR when a swing has come to rest
+volatile uint16_t motionPhase = 0;          // Wraps once per full swing cycle
+volatile uint16_t motionPhaseStep = 0;      // Phase advance per servo update
+volatile unsigned int motionAmplitude = 0;  // Current amplitude, 8.8 fixed point degrees
+volatile unsigned int motionTargetAmplitude = 0;
+volatile byte motionCyclesLeft = 0;
+byte motionTicks = 0;                       // ISR-only
 
-// Buzzer state
-bool isBuzzerActive = false;
-unsigned long buzzerPatternStartTime = 0;
-int beepCount = 0;
-enum BuzzerMode { OFF, CRY_ALERT, WET_ALERT };
-BuzzerMode buzzerMode = OFF;
+// Soothing controller: while the baby cries the cradle swings with no cycle
+// limit and an amplitude that follows cry intensity (fast attack, slow release),
+// then winds down once there has been no crying for config.quietTime.
+#define SOOTHE_MIN_AMPLITUDE 8      // Degrees at the faintest sound that counts as crying
+#define SOOTHE_RELEASE_STEP 4       // Intensity the level falls per controller run (100 ms)
+#define SOOTHE_RETUNE_STEP 2        // Degrees the amplitude must change before a retune
+bool isSoothing = false;
+byte cryIntensity = 0;              // 0-255, from the latest sound window
+byte sootheLevel = 0;               // Smoothed intensity driving the amplitude
+byte sootheAmplitude = 0;           // Degrees the swing was last tuned to
 
-// --- SETUP FUNCTION ---
-void setup() {
-    Serial.begin(9600);
-    gsm.begin(9600);
-    dht.begin();
+// Quarter-wave sine, sin(i * 90 / 64 degrees) * 255
+const byte SINE_TABLE[65] PROGMEM = {
+      0,   6,  13,  19,  25,  31,  37,  44,  50,  56,  62,  68,  74,
+     80,  86,  92,  98, 103, 109, 115, 120, 126, 131, 136, 142, 147,
+    152, 157, 162, 167, 171, 176, 180, 185, 189, 193, 197, 201, 205,
+    208, 212, 215, 219, 222, 225, 228, 231, 233, 236, 238, 240, 242,
+    244, 246, 247, 249, 250, 251, 252, 253, 254, 254, 255, 255, 255,
+};
 
-    lcd.begin(16, 2);
-    lcd.backlight();
-    lcd.setCursor(0, 0);
-    lcd.print(" Baby Monitor ");
+// Buzzer state: patterns are flash tables played by the Timer2 tick. A pattern
+// with a higher priority interrupts the one playing, others wait in one slot.
+enum BuzzerMode { OFF, CRY_ALERT, WET_ALERT, BUZZER_MODE_COUNT };
+enum BuzzerStepKind { BUZZ_END, BUZZ_ON, BUZZ_OFF, BUZZ_TONE }; // TONE: 500 Hz square wave
+struct BuzzerStep {
+    byte kind;
+    byte duration; // Units of 10 ms
+};
+const BuzzerStep CRY_PATTERN[] PROGMEM = { { BUZZ_ON, 20 }, { BUZZ_OFF, 20 }, { BUZZ_END, 0 } }; // Fast beep
+const BuzzerStep WET_PATTERN[] PROGMEM = { { BUZZ_ON, 50 }, { BUZZ_OFF, 50 }, { BUZZ_END, 0 } }; // Slow beep
+const BuzzerStep* const BUZZER_PATTERNS[BUZZER_MODE_COUNT] PROGMEM = { NULL, CRY_PATTERN, WET_PATTERN };
+const byte BUZZER_PRIORITIES[BUZZER_MODE_COUNT] PROGMEM = { 0, 2, 1 };
+volatile BuzzerMode buzzerMode = OFF;        // Pattern playing
+volatile BuzzerMode buzzerPendingMode = OFF; // Pattern waiting for it to finish
+volatile byte buzzerPendingRepeats = 0;
+const BuzzerStep* buzzerStep = NULL;         // ISR-owned playback position
+byte buzzerStepKind = BUZZ_OFF;
+unsigned int buzzerStepTicks = 0;
+byte buzzerRepeatsLeft = 0;
+#define BUZZER_MUTE_TIME 1800000UL  // MUTE silences new patterns for 30 minutes
+bool buzzerMuted = false;
+unsigned long buzzerMuteTime = 0;
 
-    pinMode(FAN_RELAY_PIN, OUTPUT);
-    digitalWrite(FAN_RELAY_PIN, HIGH); // Fan OFF initially
+// GSM / SMS state
+#define GSM_BOOT_TIME 3000          // Time the module needs after power-on before it answers
+#define GSM_PROBE_TIMEOUT 1000      // Max wait for OK to each AT probe
+#define GSM_PROBE_ATTEMPTS 5
+#define GSM_RETRY_INTERVAL 30000    // Wait before probing again after bring-up failed
+#define GSM_HEALTH_CHECK_INTERVAL 60000 // Re-probe a modem silent this long to detect drops
+#define GSM_PROMPT_TIMEOUT 5000     // Max wait for the '>' prompt after AT+CMGS
+#define GSM_RESULT_TIMEOUT 60000    // Max wait for +CMGS/ERROR after Ctrl+Z
+#define GSM_BAUD 9600               // Modem default rate, always tried first
+#if GSM_PORT == GSM_PORT_SOFTWARE
+#define GSM_FAST_BAUD 0             // SoftwareSerial is unreliable above 38400: stay at GSM_BAUD
+#else
+#define GSM_FAST_BAUD 57600         // Negotiated with AT+IPR once the modem answers
+#endif
+enum GsmState {
+    GSM_POWER_UP, GSM_PROBE, GSM_SET_BAUD, GSM_CONFIGURE, GSM_CLEAR_SIM, GSM_SET_NOTIFY, GSM_OFFLINE, // Bring-up
+    GSM_READY,                                           // Idle, can accept an SMS
+    GSM_WAIT_PROMPT, GSM_WRITE_BODY, GSM_WAIT_RESULT,    // Outbound SMS transaction
+    GSM_READ_SMS, GSM_DELETE_SMS,                        // Inbound SMS transaction
+    GSM_CALL_DIAL, GSM_CALL_RINGING, GSM_CALL_HANGUP,    // Voice call alert
+#if ENABLE_TELEMETRY
+    GSM_LINK_SHUT, GSM_LINK_RXMODE, GSM_LINK_APN,        // Telemetry link bring-up
+    GSM_LINK_ATTACH, GSM_LINK_ADDRESS, GSM_LINK_CONNECT,
+    GSM_DATA_PROMPT, GSM_WRITE_DATA, GSM_DATA_RESULT     // Outbound TCP send
+#endif
+};
+GsmState gsmState = GSM_POWER_UP;
+unsigned long gsmStateStartTime = 0;
+unsigned long gsmAnswerTime = 0;    // Last line from the modem. Not reset by a state change: a
+                                    // link attempt that times out must not postpone the probe
+int gsmProbeAttempts = 0;
+bool gsmConnected = false;
+bool gsmClearSim = true;            // Messages may sit on the SIM without a +CMTI: after power-up
+                                    // and when smsInbox overflowed. Cleared at the next bring-up.
+unsigned long gsmBaud = GSM_BAUD;
+const char* smsMessage = NULL;  // Body text in PROGMEM...
+const char* smsSuffix = NULL;   // ...followed by an optional suffix in RAM
+const char* smsNextChar = NULL;
+bool smsInSuffix = false;
 
-    pinMode(BUZZER_PIN, OUTPUT);
-    digitalWrite(BUZZER_PIN, LOW);
+// Inbound SMS: +CMTI notifications queue SIM indexes, which are then read with
+// AT+CMGR and deleted with AT+CMGD once the GSM engine is otherwise idle
+#define SMS_INBOX_SIZE 4
+#define SMS_COMMAND_LENGTH 32
+#define SMS_REPLY_LENGTH 64
+byte smsInbox[SMS_INBOX_SIZE];
+byte smsInboxHead = 0;
+byte smsInboxCount = 0;
+bool smsBodyNext = false;                  // +CMGR: header read, the next line is the body
+char smsSender[PHONE_NUMBER_LENGTH];
+char smsCommand[SMS_COMMAND_LENGTH];
+char smsReplyText[SMS_REPLY_LENGTH];       // Sent after MSG_SMS_REPLY by the alert queue; the
+                                           // next command is only read once it has gone out
+byte smsReplyRecipient = 0;                // Sender of the command being answered
 
-    cradleServo.attach(SERVO_PIN);
-    cradleServo.write(CRADLE_POS_REST);
+// Trends: one two-byte sample per TREND_INTERVAL over the last 24 h. The
+// temperature is a delta on the previous sample, so tenths of a degree fit a
+// byte. The window statistics are updated as samples enter and leave the ring,
+// so reading them costs nothing.
+#define TREND_INTERVAL 1200000UL    // 20 min per sample
+#define TREND_SAMPLES 72            // 24 h
+#define TREND_NO_READING INT8_MIN   // Temperature delta of a sample without a valid reading
+#define TREND_CRY_UNIT (TREND_INTERVAL / 15) // Crying time resolution, 15 units fill an interval
+struct TrendSample {
+    int8_t temperatureDelta;        // Tenths of a degree C on the previous reading, saturating
+    byte activity;                  // Cry episodes (0-7) << 5 | wet << 4 | crying time in TREND_CRY_UNITs
+};
+TrendSample trendRing[TREND_SAMPLES];
+byte trendHead = 0;                 // Oldest sample
+byte trendCount = 0;
+bool trendHasTemperature = false;
+int trendBaseTemperature = 0;       // Tenths, what the oldest delta in the ring applies to
+int trendLastTemperature = 0;       // Tenths, the newest reading as stored (after saturation)
+long trendTemperatureSum = 0;       // Window statistics, temperatures in tenths
+byte trendTemperatureCount = 0;
+int trendMinTemperature = 0;
+int trendMaxTemperature = 0;
+unsigned int trendCries = 0;
+unsigned int trendCryUnits = 0;
+byte trendWetSamples = 0;
+unsigned long trendIntervalStart = 0; // Accumulators for the sample being collected
+byte trendIntervalCries = 0;
+unsigned long trendIntervalCryTime = 0;
+unsigned long trendCryStartTime = 0;
+bool trendIntervalWet = false;
+
+// Boot self-test: for SELFTEST_TIME after boot, beside the GSM bring-up, checks
+// that every sensor answers and measures the soil and sound baselines of a unit
+// that has not been calibrated yet. Then it waits for the modem's verdict.
+#define SELFTEST_TIME 5000          // ms of sensor checks and calibration
+#define SOIL_WET_PERCENT 80         // Wet below this share of the dry baseline...
+#define SOIL_DRY_PERCENT 90         // ...dry again above it
+#define SOIL_MIN_DRY_LEVEL 400      // A lower baseline is a wet or shorted probe
+#define SOIL_MAX_SPREAD 16          // Filtered readings of a working probe stay this close
+#define SOUND_MAX_FLOOR 100         // A noisier room is not used as the floor
+enum SelfTestFault { FAULT_DHT = 1, FAULT_SOIL = 2, FAULT_SOUND = 4, FAULT_MODEM = 8, FAULT_COUNT = 4 };
+const char FAULT_NAMES[FAULT_COUNT][6] PROGMEM = { "dht", "soil", "sound", "modem" };
+enum SelfTestState { SELFTEST_SENSORS, SELFTEST_MODEM, SELFTEST_DONE };
+SelfTestState selfTestState = SELFTEST_DONE;
+unsigned long selfTestStartTime = 0;
+byte selfTestFaults = 0;            // SelfTestFault bits of the last run
+byte selfTestCalibrating = 0;       // CALIBRATED_ bits measured in this run
+unsigned long soilBaselineSum = 0;
+unsigned int soilBaselineCount = 0;
+unsigned int soilBaselineMin = 0;
+unsigned int soilBaselineMax = 0;
+unsigned int soundPeakLevel = 0;
+bool soundAlwaysActive = false;     // No window of the run had any silence
+
+#if ENABLE_TELEMETRY
+// Telemetry uplink: samples are delta-encoded into a frame that goes out as a
+// single MQTT PUBLISH (QoS 0) over the modem's TCP stack, one per batch.
+// Alerts still go out by SMS, which stays the path that reaches the parent.
+//
+// Frame: version, sample interval (s), sample count, uptime of the first
+// sample (s, 4 bytes), the first sample as FIELD_COUNT big-endian words, then
+// per sample a mask of the fields that changed followed by each change as a
+// signed byte, or TELEMETRY_ESCAPE and the new value as a word.
+#define TELEMETRY_SAMPLE_INTERVAL 10000 // ms between samples
+#define TELEMETRY_BATCH 6               // Samples per frame: one PUBLISH a minute
+#define TELEMETRY_FRAME_VERSION 1
+#define TELEMETRY_FRAME_HEADER 7
+#define TELEMETRY_FRAME_SIZE 88         // Holds a few minutes of samples while the link is down
+#define TELEMETRY_HEAD_SIZE 40          // MQTT fixed header and topic, or a whole CONNECT
+#define TELEMETRY_NO_READING -32768
+#define TELEMETRY_ESCAPE 0x80
+#define TELEMETRY_RETRY_INTERVAL 60000  // Wait after the link failed before bringing it up again
+#define TELEMETRY_KEEPALIVE 300         // MQTT keep-alive in seconds, several frame intervals
+#define GPRS_ATTACH_TIMEOUT 85000       // AT+CIICR can take most of a minute and a half
+#define TCP_CONNECT_TIMEOUT 30000       // Max wait for CONNECT OK after AT+CIPSTART
+#define TCP_SEND_TIMEOUT 10000          // Max wait for SEND OK after the data
+#define TELEMETRY_FLAG_CRYING 0x01
+#define TELEMETRY_FLAG_WET 0x02
+#define TELEMETRY_FLAG_FAN 0x04
+#define TELEMETRY_FLAG_SWINGING 0x08
+#define TELEMETRY_FLAG_HOT 0x10
+#define MQTT_CONNECT 0x10
+#define MQTT_PUBLISH 0x30               // QoS 0, not retained
+enum TelemetryField { FIELD_TEMPERATURE, FIELD_HUMIDITY, FIELD_SOIL, FIELD_SOUND, FIELD_FLAGS, FIELD_COUNT };
+#define TELEMETRY_SAMPLE_MAX (1 + 3 * FIELD_COUNT) // Largest encoding of a later sample
+struct TelemetrySample {
+    int values[FIELD_COUNT]; // Tenths of degC, % RH, soil ADC, peak sound ms / 2, TELEMETRY_FLAGs
+};
+// Protocol name, level 4 (3.1.1), clean session, keep-alive
+const byte MQTT_CONNECT_HEADER[] PROGMEM = {
+    0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, TELEMETRY_KEEPALIVE >> 8, TELEMETRY_KEEPALIVE & 0xFF
+};
+byte telemetryFrame[TELEMETRY_FRAME_SIZE];
+byte telemetryFrameLength = 0;
+TelemetrySample telemetryLast;          // Previous sample, the base of the next deltas
+TelemetrySample telemetryPending;       // Taken while a frame was in flight
+bool telemetryPendingValid = false;
+unsigned long telemetryPendingTime = 0;
+unsigned int telemetrySoundPeak = 0;    // Largest windowActiveMs since the last sample
+bool telemetryLinkUp = false;           // TCP open and the MQTT CONNECT accepted by the modem
+bool telemetryConnecting = false;       // The data in flight is the CONNECT packet
+bool telemetrySending = false;          // The data in flight is the current frame
+bool telemetryRetrying = false;
+unsigned long telemetryRetryTime = 0;
+unsigned long telemetryFramesSent = 0;
+unsigned long telemetryFramesDropped = 0;
+unsigned long telemetryBytesSent = 0;
+byte telemetryHead[TELEMETRY_HEAD_SIZE];
+byte telemetryHeadLength = 0;
+const byte* telemetryBody = NULL;       // Bytes sent after telemetryHead
+byte telemetryBodyLength = 0;
+byte telemetryDataNext = 0;             // Index into head + body of the next byte to write
+#endif
+
+// AT response tokenizer (fixed buffer, no String objects)
+#define AT_LINE_LENGTH 48
+enum AtResponse {
+    AT_NONE, AT_OK, AT_ERROR, AT_PROMPT, AT_CMGS, AT_CMTI, AT_CMGR,
+    AT_SHUT_OK, AT_CONNECT, AT_SEND_OK, AT_CLOSED, AT_CALL_ENDED, AT_LINE,
+    AT_SMS_BODY // The line after +CMGR:, never matched against the keywords
+};
+struct AtKeyword {
+    char text[14];
+    byte response; // AtResponse
+    bool isPrefix; // Line only has to start with the keyword
+};
+const AtKeyword AT_KEYWORDS[] PROGMEM = {
+    { "OK", AT_OK, false },
+    { "ERROR", AT_ERROR, false },
+    { "+CMS ERROR:", AT_ERROR, true },
+    { "+CME ERROR:", AT_ERROR, true },
+    { "+CMGS:", AT_CMGS, true },
+    { "+CMTI:", AT_CMTI, true },
+    { "+CMGR:", AT_CMGR, true },
+    { "SHUT OK", AT_SHUT_OK, false },
+    { "CONNECT OK", AT_CONNECT, false },
+    { "ALREADY", AT_CONNECT, true },       // ALREADY CONNECT
+    { "CONNECT FAIL", AT_ERROR, false },
+    { "SEND OK", AT_SEND_OK, false },
+    { "SEND FAIL", AT_ERROR, false },
+    { "CLOSED", AT_CLOSED, false },
+    { "+PDP: DEACT", AT_CLOSED, false },
+    { "NO ", AT_CALL_ENDED, true },        // NO CARRIER, NO ANSWER, NO DIALTONE
+    { "BUSY", AT_CALL_ENDED, false }
+};
+#define AT_KEYWORD_COUNT (sizeof(AT_KEYWORDS) / sizeof(AT_KEYWORDS[0]))
+#define AT_ALL_KEYWORDS ((1UL << AT_KEYWORD_COUNT) - 1)
+char atLine[AT_LINE_LENGTH];     // Current line, truncated if longer than the buffer
+int atLineLength = 0;            // Characters seen on the current line
+unsigned long atCandidates = AT_ALL_KEYWORDS; // Keywords the line still matches
+long atNumber = 0;               // Last run of digits on the line (+CMGS ref, +CMTI index)
+bool atInNumber = false;
+
+// Alert engine: each alert type has a priority, and the priority decides the
+// channels. Outbound messages and calls wait in a queue that is served highest
+// priority first, oldest first within a level. An escalating alert is passed
+// down the recipient list until someone answers ACK by SMS.
+#define ALERT_QUEUE_SIZE 6
+#define ALERT_COALESCE_WINDOW 120000UL // Repeats of an alert within this window are merged
+#define ESCALATION_INTERVAL 300000UL   // Unacknowledged alert goes to the next number after 5 min
+#define CALL_RING_TIME 30000           // A voice call alert rings this long, then hangs up
+#define SMS_MAX_PER_MINUTE 3
+#define SMS_REFUSED_RETRY 30000UL      // Wait after the modem answers ERROR to a message
+#define SMS_MAX_REFUSALS 3             // Then drop it: the number or the SIM is at fault
+#define SMS_SUFFIX_LENGTH 24
+enum AlertPriority { PRIORITY_INFO, PRIORITY_NORMAL, PRIORITY_HIGH, PRIORITY_CRITICAL, PRIORITY_COUNT };
+#define CHANNEL_BUZZER 0x01
+#define CHANNEL_SMS 0x02
+#define CHANNEL_CALL 0x04                // Ring the number after the SMS
+#define CHANNEL_ESCALATE 0x08            // Pass on to the next number until acknowledged
+const byte PRIORITY_CHANNELS[PRIORITY_COUNT] PROGMEM = {
+    CHANNEL_SMS,                                                    // INFO
+    CHANNEL_BUZZER | CHANNEL_SMS,                                   // NORMAL
+    CHANNEL_BUZZER | CHANNEL_SMS | CHANNEL_ESCALATE,                // HIGH
+    CHANNEL_BUZZER | CHANNEL_SMS | CHANNEL_CALL | CHANNEL_ESCALATE, // CRITICAL
+};
+enum AlertType { ALERT_CRY, ALERT_WET, ALERT_HEAT, ALERT_REPLY, ALERT_TYPE_COUNT };
+struct AlertPolicy {
+    byte message;    // MessageId of the SMS text
+    byte priority;   // AlertPriority
+    byte buzzerMode; // BuzzerMode, if the priority sounds the buzzer
+};
+const AlertPolicy ALERT_POLICIES[ALERT_TYPE_COUNT] PROGMEM = {
+    { MSG_SMS_CRY,   PRIORITY_HIGH,     CRY_ALERT },
+    { MSG_SMS_WET,   PRIORITY_NORMAL,   WET_ALERT },
+    { MSG_SMS_HEAT,  PRIORITY_CRITICAL, CRY_ALERT },
+    { MSG_SMS_REPLY, PRIORITY_INFO,     OFF },
+};
+struct QueuedAlert {
+    byte type;               // AlertType
+    byte recipient;          // Index into config.phoneNumbers
+    bool call;               // A voice call rather than an SMS
+    int count;               // Number of merged occurrences
+    unsigned long firstTime; // When the first merged occurrence happened
+    bool inFlight;           // SMS handed to the modem, removed once +CMGS confirms it
+    byte refusals;           // Times the modem answered ERROR to it
+};
+QueuedAlert alertQueue[ALERT_QUEUE_SIZE]; // In arrival order
+int alertQueueCount = 0;
+struct Escalation {
+    byte type;               // AlertType waiting for an ACK, ALERT_TYPE_COUNT if none
+    byte recipient;          // Last number it went to
+    unsigned long time;      // When it went there
+};
+Escalation escalation = { ALERT_TYPE_COUNT, 0, 0 };
+bool alertEverSent[ALERT_TYPE_COUNT];
+unsigned long alertLastSentTime[ALERT_TYPE_COUNT];
+int alertHeldCount[ALERT_TYPE_COUNT];             // Repeats waiting for the window to close
+unsigned long alertHeldFirstTime[ALERT_TYPE_COUNT];
+unsigned long smsSendTimes[SMS_MAX_PER_MINUTE];   // Ring of recent send times for rate limiting
+int smsSendTimesIndex = 0;
+int smsSentCount = 0;
+char alertSuffix[SMS_SUFFIX_LENGTH]; // Repeat count appended to a coalesced alert
+int inFlightCount = 0;               // Occurrences the in-flight SMS reports
+bool smsRefused = false;             // The last SMS was refused at smsRefusedTime
+unsigned long smsRefusedTime = 0;
+
+// LCD shadow frame buffer
+#define LCD_COLS 16
+#define LCD_ROWS 2
+#define LCD_CHARS_PER_PASS 4 // Max characters sent over I2C per loop pass
+char lcdFrame[LCD_ROWS][LCD_COLS]; // Frame the display should show
+char lcdShown[LCD_ROWS][LCD_COLS]; // What is currently on the glass
+int lcdCursorRow = -1;             // Position of the LCD's own cursor, -1 if unknown
+int lcdCursorCol = -1;
+// A display that stops acknowledging on I2C is left alone and recovered in the
+// background; the rest of the system runs on without it.
+#define LCD_RETRY_INTERVAL 5000    // ms between bus recovery attempts while faulted
+bool lcdFault = false;
+unsigned long lcdFaultTime = 0;
+
+// Event bus: sensor tasks publish typed events into a fixed-size lock-free
+// single-producer/single-consumer ring; the events task hands them to the
+// subscribers in batches.
+#define EVENT_QUEUE_SIZE 16         // Power of two
+#define EVENT_BATCH 8               // Events dispatched per run of the events task
+enum EventType {
+    EVT_TEMP_SAMPLE, EVT_CRY_START, EVT_CRY_END, EVT_WET, EVT_DRY, EVT_HEAT, EVT_HEAT_OK, EVENT_TYPE_COUNT
+};
+#define EVENT_BIT(type) (1U << (type))
+struct Event {
+    byte type;  // EventType
+    int value;  // TEMP_SAMPLE/HEAT/HEAT_OK: heat index in tenths of a degree C; CRY_START: active ms; WET/DRY: soil value
+};
+struct Subscriber {
+    unsigned int eventMask; // EVENT_BITs the subscriber wants
+    void (*handle)(const Event& event);
+};
+Event eventQueue[EVENT_QUEUE_SIZE];
+volatile byte eventHead = 0;  // Next slot to fill; written only by the producer
+volatile byte eventTail = 0;  // Next slot to dispatch; written only by the consumer
+unsigned int eventsDropped = 0;
 
-    pinMode(SOIL_SENSOR_PIN, INPUT);
+// Event log: fixed-width binary records collected in a RAM ring and written to
+// the top of the EEPROM one page at a time. Pages are used in rotation, newest
+// identified by its sequence number, so every page wears at the same rate.
+enum LogType {
+    LOG_BOOT, LOG_CRY_START, LOG_CRY_END, LOG_WET, LOG_DRY, LOG_FAN_ON, LOG_FAN_OFF,
+    LOG_HOT, LOG_COOL, LOG_ACK, LOG_SELFTEST, LOG_TYPE_COUNT
+};
+const char LOG_TYPE_NAMES[LOG_TYPE_COUNT][8] PROGMEM = {
+    "boot", "cry on", "cry off", "wet", "dry", "fan on", "fan off", "hot", "cool", "ack", "test"
+};
+struct LogRecord {
+    uint16_t delta; // Seconds since the previous record, saturating
+    byte type;      // LogType
+    byte value;     // BOOT: reset cause * 16 + task; CRY_START: active ms / 2; WET/DRY: soil / 4;
+                    // FAN/HOT/COOL: temperature C; ACK: recipient; SELFTEST: SelfTestFault bits
+};
+#define LOG_RECORDS_PER_PAGE 7
+struct LogPage {
+    uint16_t sequence;
+    byte count;     // Records used, 1..LOG_RECORDS_PER_PAGE
+    byte checksum;  // Sum of every other byte of the page
+    LogRecord records[LOG_RECORDS_PER_PAGE];
+};
+#define LOG_PAGES 16
+#define LOG_START (E2END + 1 - LOG_PAGES * sizeof(LogPage))
+#define LOG_RAM_RECORDS 14          // Two pages' worth, so logging continues while one is written
+#define LOG_FLUSH_INTERVAL 600000UL // Write a partial page after 10 minutes
+LogRecord logRing[LOG_RAM_RECORDS];
+byte logRingHead = 0;
+byte logRingCount = 0;
+unsigned int logDropped = 0;
+unsigned long logLastTime = 0;     // millis() of the previous record, in whole seconds
+unsigned long logOldestTime = 0;   // millis() when the oldest unwritten record was added
+LogPage logPage;                   // Page being written
+byte logNextPage = 0;
+uint16_t logSequence = 0;
+int logDumpPage = -1;              // Pages left to dump over Serial, -1 when idle
+byte logDumpRecord = 0;
+unsigned long logDumpTime = 0;
+
+// Background EEPROM writer: one byte per call, only when the EEPROM is ready
+const byte* eepromSource = NULL;
+int eepromAddress = 0;
+byte eepromRemaining = 0;
+bool eepromChanged = false;        // A byte of the current block was written, commit pending
+
+// Power management. Power-save/power-down sleep would stop Timer0 and Timer2
+// (both clocked from the CPU clock), and with them millis() and sound sampling,
+// so the quiet state sleeps in IDLE like the rest but also turns the backlight off.
+#define QUIET_DELAY 60000           // ms with nothing in progress before going quiet
+enum PowerMode { POWER_RUN, POWER_IDLE, POWER_QUIET, POWER_MODE_COUNT };
+// Supply current of the whole unit in each mode, in mA, with fan, servo and
+// GSM idle. Nominal figures: replace with a bench reading of the actual build.
+const unsigned int POWER_MODE_CURRENT[POWER_MODE_COUNT] PROGMEM = { 48, 41, 24 };
+const char POWER_MODE_NAMES[POWER_MODE_COUNT][6] PROGMEM = { "run", "idle", "quiet" };
+bool isQuiet = false;
+unsigned long lastBusyTime = 0;
+unsigned long powerModeSeconds[POWER_MODE_COUNT];
+unsigned long powerModeMicros[POWER_MODE_COUNT];  // Remainder below one second
+unsigned long powerMarkTime = 0;                  // micros() at the last mode change
+
+// Scheduler state
+struct Task {
+    void (*run)(unsigned long currentTime);
+    unsigned long period;   // Milliseconds between runs
+    unsigned long nextRun;  // millis() deadline of the next run
+    byte priority;          // Higher wins when several tasks are due
+    unsigned int budget;    // Worst-case run time in microseconds
+    unsigned int overruns;  // Runs that took longer than the budget
+};
+
+enum TaskId {
+    TASK_CRADLE, TASK_GSM, TASK_EVENTS, TASK_SOUND, TASK_LCD_FLUSH,
+    TASK_SOIL, TASK_DISPLAY, TASK_TEMPERATURE, TASK_CONSOLE, TASK_POWER, TASK_STORAGE, TASK_TREND, TASK_SELFTEST,
+#if ENABLE_TELEMETRY
+    TASK_TELEMETRY,
+#endif
+    TASK_COUNT
+};
+
+#define TASK_BIT(id) (1U << (id))
+#define ALL_TASKS (TASK_BIT(TASK_COUNT) - 1)
+// Tasks that talk to the modem. Boards with a second core run them there, so
+// slow radio work never delays sensing and actuation.
+#if ENABLE_TELEMETRY
+#define RADIO_TASKS (TASK_BIT(TASK_GSM) | TASK_BIT(TASK_TELEMETRY))
+#else
+#define RADIO_TASKS TASK_BIT(TASK_GSM)
+#endif
+
+// Watchdog: the scheduler feeds the hardware watchdog only while every task
+// keeps meeting its deadlines. A task that never returns lets it expire; one
+// that stops being run triggers a deliberate reset. Either way the cause and
+// the task survive the reset in .noinit RAM and are logged on the next boot.
+#define TASK_STALL_TIME 5000        // ms past its deadline before a task counts as stalled
+#define RESET_REPORT_MAGIC 0xB007   // Marks resetReport as written before a reset
+enum ResetCause {
+    RESET_POWER_ON, RESET_EXTERNAL, RESET_BROWNOUT, RESET_WATCHDOG, RESET_TASK_HUNG, RESET_TASK_STALLED,
+    RESET_UNKNOWN,  // The bootloader cleared the flags and did not pass them on
+    RESET_CAUSE_COUNT
+};
+const char RESET_CAUSE_NAMES[RESET_CAUSE_COUNT][10] PROGMEM = {
+    "power on", "reset pin", "brown-out", "watchdog", "task hung", "stalled", "unknown"
+};
+struct ResetReport {
+    uint16_t magic;
+    byte cause;     // ResetCause
+    byte task;      // TaskId, TASK_COUNT if no task was running
+};
+ResetReport resetReport HAL_NOINIT;
+volatile byte currentTask = TASK_COUNT; // Task running right now, TASK_COUNT between tasks
+ResetCause lastResetCause = RESET_POWER_ON;
+byte lastResetTask = TASK_COUNT;
+const char TASK_NAMES[TASK_COUNT + 1][8] PROGMEM = {
+    "cradle", "gsm", "events", "sound", "lcd", "soil", "display", "dht", "console", "power", "storage", "trend", "test",
+#if ENABLE_TELEMETRY
+    "uplink",
+#endif
+    "none"
+};
+
+// Serial console
+#define CONSOLE_LINE_LENGTH 32
+char consoleLine[CONSOLE_LINE_LENGTH];
+int consoleLineLength = 0;
+
+#if ENABLE_PROFILING
+// Profiling: run-time statistics per task, plus one entry for whole scheduler passes
+#define PROFILE_BUCKETS 12          // Histogram buckets: < 8 us, < 16 us, ... >= 8 ms
+#define PROFILE_PASS TASK_COUNT
+#define LOOP_BUDGET_US 4000         // A scheduler pass longer than this is an overrun
+struct ProfileStats {
+    unsigned long count;
+    unsigned long totalTime;
+    unsigned int minTime;
+    unsigned int maxTime;
+    unsigned int histogram[PROFILE_BUCKETS];
+};
+ProfileStats profileStats[TASK_COUNT + 1];
+unsigned long loopOverruns = 0;
+unsigned long lastProfileReportTime = 0;
+#endif
+
+// --- COMPILE-TIME CHECKS ---
+// Settings that only make sense together, caught by the compiler instead of
+// showing up as a dead relay or a corrupted EEPROM on the bench.
+static_assert(WETNESS_THRESHOLD < DRYNESS_THRESHOLD, "Wet/dry thresholds need a gap for hysteresis");
+static_assert(SOIL_WET_PERCENT < SOIL_DRY_PERCENT && SOIL_DRY_PERCENT < 100,
+              "Calibrated wet/dry thresholds need a gap below the dry baseline");
+static_assert(CRY_MIN_ACTIVE_MS + SOUND_MAX_FLOOR < CRY_WINDOW_BINS * CRY_BIN_MS,
+              "A calibrated cry limit must stay reachable within the window");
+static_assert(CRADLE_POS_MIN < CRADLE_POS_REST && CRADLE_POS_REST < CRADLE_POS_MAX,
+              "Cradle rest position must lie inside the swing range");
+static_assert(SOOTHE_MIN_AMPLITUDE < CRADLE_POS_MAX - CRADLE_POS_REST, "Gentlest soothing swing exceeds the full one");
+static_assert(SOOTHE_QUIET_TIME * 1000UL > CRY_QUIET_TIME, "Soothing must outlast the cry detector's quiet time");
+static_assert((EVENT_QUEUE_SIZE & (EVENT_QUEUE_SIZE - 1)) == 0, "EVENT_QUEUE_SIZE must be a power of two");
+static_assert(sizeof(LogPage) == 32, "Log pages must stay aligned to the EEPROM page size");
+static_assert(sizeof(Config) <= LOG_START, "Config block overlaps the event log");
+static_assert(CRITICAL_TEMPERATURE > TEMPERATURE_THRESHOLD, "Critical alert must lie above the fan threshold");
+static_assert(sizeof(AT_KEYWORDS) / sizeof(AT_KEYWORDS[0]) < 32, "atCandidates has one bit per keyword");
+static_assert(TASK_COUNT < 16, "The BOOT log record packs the task ID into four bits");
+#if ENABLE_TELEMETRY
+static_assert(2 + sizeof(TELEMETRY_TOPIC) - 1 + TELEMETRY_FRAME_SIZE < 128,
+              "PUBLISH must fit a one-byte MQTT remaining length");
+static_assert(4 + sizeof(TELEMETRY_TOPIC) - 1 <= TELEMETRY_HEAD_SIZE
+              && 2 + sizeof(MQTT_CONNECT_HEADER) + 2 + sizeof(TELEMETRY_CLIENT_ID) - 1 <= TELEMETRY_HEAD_SIZE,
+              "TELEMETRY_HEAD_SIZE too small for the topic or client id");
+#endif
+
+// --- HARDWARE ABSTRACTION ---
+// The control logic reaches the board only through the hal*() functions below
+// and the gsm / console streams. The interrupt handlers here just forward to
+// timerTick(), addSoilReading(), dhtEdgeISR() and watchdogExpired(), which a HAL_HOST build calls
+// itself while replaying a recorded sensor trace on a simulated clock.
+// There is one implementation per board target: ESP32, then the AVR boards
+// (Uno/Nano and Mega), then the LCD code they share.
+#if HAL_HOST
+unsigned long halMillis();
+unsigned long halMicros();
+void halStartSerial(unsigned long gsmBaud);
+void halGsmBegin(unsigned long baud);
+void halStartPins();
+bool halSoundActive();
+void halSetBuzzer(bool on);
+void halToggleBuzzer();
+void halWriteFan(byte duty);
+void halServoAttach(byte degrees);
+void halServoWrite(byte degrees);
+void halLcdBegin();
+void halLcdBacklight(bool on);
+void halLcdSetCursor(byte col, byte row);
+void halLcdWrite(char c);
+bool halLcdTimedOut();
+void halLcdRecover();
+bool halEepromReady();
+byte halEepromRead(int address);
+void halStartStorage();
+void halEepromWrite(int address, byte value);
+void halEepromCommit();
+void halIdle();
+void halPowerDownUnused();
+void halStartTick();
+void halStartSoilADC();
+void halDhtStart();
+void halDhtListen();
+void halDhtStop();
+ResetCause halResetCause();
+void halWatchdogStart();
+void halWatchdogFeed();
+void halReset();
+#if ENABLE_PROFILING
+void halPaintFreeSRAM();
+int halFreeSRAM();
+int halFreeSRAMLowWater();
+#endif
+#elif BOARD == BOARD_ESP32
+static_assert(SOIL_SENSOR_PIN >= 32 && SOIL_SENSOR_PIN <= 39, "SOIL_SENSOR_PIN must be an ADC1 input");
+static_assert(configTICK_RATE_HZ == 1000, "The 1 kHz tick is one FreeRTOS tick");
+
+// The control core runs loop() and the tick task; the radio core, which also
+// hosts the Wi-Fi/BT stack, runs the modem tasks.
+#define CONTROL_CORE 1
+#define RADIO_CORE 0
+#define TICK_TASK_PRIORITY (configMAX_PRIORITIES - 1) // Stands in for the AVR timer interrupt
+#define RADIO_TASK_PRIORITY 1                         // Same as loop()
+#define HAL_STACK_SIZE 4096
+#define WATCHDOG_TIMEOUT 2000       // ms; far above any task's budget, below a user's patience
+#define SERVO_PWM_BITS 14           // 50 Hz: one count is ~1.2 us
+#define SERVO_MIN_PULSE 544         // us at 0 degrees, as in the AVR Servo library
+#define SERVO_MAX_PULSE 2400        // us at 180 degrees
+#define FAN_PWM_FREQUENCY 1000      // Hz, as on Timer2
+
+SemaphoreHandle_t taskLock = NULL;
+bool soilSampling = false;
+volatile unsigned long watchdogFeedTime[HAL_CORES]; // Per core, by the scheduler loop running there
+bool watchdogRunning = false;
+bool buzzerLevel = false;           // Output latch, so the buzzer can be toggled
+
+unsigned long halMillis() {
+    return millis();
+}
+
+unsigned long IRAM_ATTR halMicros() {
+    return micros();
+}
+
+void halStartSerial(unsigned long gsmBaud) {
+    Serial.begin(115200);
+    gsm.begin(gsmBaud, SERIAL_8N1, GSM_RX_PIN, GSM_TX_PIN);
+}
+
+void halGsmBegin(unsigned long baud) {
+    gsm.updateBaudRate(baud);
+}
+
+void halStartPins() {
+#if FAN_PWM
+    ledcAttach(FAN_RELAY_PIN, FAN_PWM_FREQUENCY, 8);
+    ledcWrite(FAN_RELAY_PIN, 0);
+#else
+    digitalWrite(FAN_RELAY_PIN, HIGH); // Relay is active low: latch off before driving
+    pinMode(FAN_RELAY_PIN, OUTPUT);
+#endif
+    digitalWrite(BUZZER_PIN, LOW);
+    pinMode(BUZZER_PIN, OUTPUT);
     pinMode(SOUND_SENSOR_PIN, INPUT);
+}
 
-    delay(2000); // Initial delay for system to stabilize
-    lcd.clear();
+bool halSoundActive() {
+    return digitalRead(SOUND_SENSOR_PIN) == SOUND_ACTIVE;
+}
 
-    initializeGSM(); 
-    Serial.println("System Ready.");
+void halSetBuzzer(bool on) {
+    buzzerLevel = on;
+    digitalWrite(BUZZER_PIN, on ? HIGH : LOW);
 }
 
-// --- MAIN LOOP ---
-void loop() {
-    unsigned long currentTime = millis();
+void halToggleBuzzer() {
+    halSetBuzzer(!buzzerLevel);
+}
+
+void halWriteFan(byte duty) {
+#if FAN_PWM
+    ledcWrite(FAN_RELAY_PIN, (unsigned int)duty * 255 / 100);
+#else
+    digitalWrite(FAN_RELAY_PIN, duty > 0 ? LOW : HIGH);
+#endif
+}
+
+void halServoAttach(byte degrees) {
+    ledcAttach(SERVO_PIN, 1000 / SERVO_UPDATE_MS, SERVO_PWM_BITS);
+    halServoWrite(degrees);
+}
+
+void halServoWrite(byte degrees) {
+    unsigned long pulse = map(degrees, 0, 180, SERVO_MIN_PULSE, SERVO_MAX_PULSE);
+    ledcWrite(SERVO_PIN, pulse * (1UL << SERVO_PWM_BITS) / (1000UL * SERVO_UPDATE_MS));
+}
+
+#define LCD_I2C_TIMEOUT 3           // ms per transfer; a healthy one takes ~0.3 ms at 100 kHz
+void halLcdBegin() {
+    Wire.begin();
+    Wire.setTimeOut(LCD_I2C_TIMEOUT);
+    lcd.begin(LCD_COLS, LCD_ROWS);
+    lcd.backlight();
+}
+
+// The ESP32 core keeps no timeout flag, so probe the display: a stuck bus or
+// a missing display fails the address phase. manageLCD() asks once per pass.
+bool halLcdTimedOut() {
+    Wire.beginTransmission(LCD_ADDRESS);
+    return Wire.endTransmission() != 0;
+}
+
+void halStartStorage() {
+    EEPROM.begin(E2END + 1);
+}
+
+bool halEepromReady() {
+    return true; // Writes only change the RAM copy
+}
+
+byte halEepromRead(int address) {
+    return EEPROM.read(address);
+}
+
+void halEepromWrite(int address, byte value) {
+    EEPROM.write(address, value);
+}
 
-    // Read sensors periodically
-    if (currentTime - lastSensorReadTime >= 500) {
-        lastSensorReadTime = currentTime;
+// Writes the RAM copy to flash. It blocks both cores for a few milliseconds,
+// so it runs once per block rather than per byte.
+void halEepromCommit() {
+    EEPROM.commit();
+}
+
+void halIdle() {
+    vTaskDelay(1); // Yields to the idle task, which sleeps until the next tick
+}
 
-        float temperature = dht.readTemperature();
-        int soilValue = analogRead(SOIL_SENSOR_PIN);
-        int soundValue = digitalRead(SOUND_SENSOR_PIN);
+void halPowerDownUnused() {
+    btStop(); // Bluetooth is unused; Wi-Fi is never started
+}
 
-        // Only proceed if temperature reading is valid
-        if (!isnan(temperature)) {
-            handleTemperature(temperature);
-            handleCry(soundValue);
-            handleUrine(soilValue);
-            updateLCD(temperature);
+// Runs timerTick() once per FreeRTOS tick, and samples the soil probe there:
+// the ESP32 ADC has no timer trigger. Being the most urgent task on the
+// control core, it also watches the scheduler loops.
+void tickTask(void*) {
+    TickType_t wakeTime = xTaskGetTickCount();
+    for (;;) {
+        vTaskDelayUntil(&wakeTime, 1);
+        bool sampled = soilSampling;
+        unsigned int reading = sampled ? analogRead(SOIL_SENSOR_PIN) >> 2 : 0; // 12 to 10 bits, as on the AVR
+        // Stands in for the AVR's interrupts-off ISR context: the ATOMIC_BLOCK
+        // readers on either core take the same lock. The ADC driver takes a
+        // mutex, so the read happens before the lock is held.
+        portENTER_CRITICAL(&halAtomicLock);
+        timerTick();
+        if (sampled) addSoilReading(reading);
+        portEXIT_CRITICAL(&halAtomicLock);
+        if (watchdogRunning) {
+            unsigned long now = millis();
+            for (byte core = 0; core < HAL_CORES; core++) {
+                if (now - watchdogFeedTime[core] > WATCHDOG_TIMEOUT) watchdogExpired();
+            }
         }
     }
-    
-    // Update ongoing actions
-    manageCradleSwing(currentTime);
-    manageBuzzer(currentTime);
-    manageDiaperAlertMessage(currentTime);
 }
 
-// --- CORE LOGIC FUNCTIONS ---
-void handleTemperature(float temperature) {
-    if (temperature > TEMPERATURE_THRESHOLD) {
-        digitalWrite(FAN_RELAY_PIN, LOW); // Turn fan ON
-    } else {
-        digitalWrite(FAN_RELAY_PIN, HIGH); // Turn fan OFF
-    }
+void halStartTick() {
+    xTaskCreatePinnedToCore(tickTask, "tick", HAL_STACK_SIZE, NULL, TICK_TASK_PRIORITY, NULL, CONTROL_CORE);
 }
 
-void handleCry(int soundValue) {
-    // If baby is crying AND cradle is not already swinging
-    if (soundValue == LOW && cradleState == IDLE) {
-        Serial.println("Baby Crying! Starting cradle and alert.");
-        cradleState = SWINGING_FORWARD; // Start the swing cycle
-        swingCycles = 3; // Swing for 3 full cycles
-        startBuzzer(CRY_ALERT, 3); // Start fast beeping
-        sendSMS(PARENT_PHONE_NUMBER, "Alert: Baby is Crying!");
-    }
+void halStartSoilADC() {
+    analogReadResolution(12);
+    analogSetPinAttenuation(SOIL_SENSOR_PIN, ADC_11db); // Full 0-3.3 V probe range
+    soilSampling = true;
 }
 
-void handleUrine(int soilValue) {
-    // If diaper is wet AND an alert is not already active
-    if (soilValue < WETNESS_THRESHOLD && !isDiaperAlertActive) {
-        Serial.println("Baby Urinated! Starting alert.");
-        isDiaperAlertActive = true;
-        diaperAlertStartTime = millis();
-        startBuzzer(WET_ALERT, 3); // Start slow beeping
-        sendSMS(PARENT_PHONE_NUMBER, "Alert: Diaper is wet. Please check.");
+void radioCoreTask(void*) {
+    for (;;) {
+        radioLoop();
     }
 }
 
-// --- ACTION MANAGEMENT FUNCTIONS (Non-Blocking) ---
+void halStartRadioCore() {
+    taskLock = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(radioCoreTask, "radio", HAL_STACK_SIZE, NULL, RADIO_TASK_PRIORITY, NULL, RADIO_CORE);
+}
 
-void manageCradleSwing(unsigned long currentTime) {
-    if (cradleState == IDLE || currentTime - lastSwingTime < CRADLE_SWING_SPEED) {
-        return; // Not swinging or not time to move yet
-    }
-    lastSwingTime = currentTime;
+void halLockTasks() {
+    xSemaphoreTake(taskLock, portMAX_DELAY);
+}
 
-    int currentPos = cradleServo.read();
+void halUnlockTasks() {
+    xSemaphoreGive(taskLock);
+}
 
-    switch (cradleState) {
-        case SWINGING_FORWARD:
-            if (currentPos < CRADLE_POS_MAX) {
-                cradleServo.write(currentPos + 1);
-            } else {
-                cradleState = SWINGING_BACK; // Reached max, swing back
-            }
-            break;
+void halDhtStart() {
+    digitalWrite(DHT_PIN, LOW);
+    pinMode(DHT_PIN, OUTPUT);
+}
 
-        case SWINGING_BACK:
-            if (currentPos > CRADLE_POS_MIN) {
-                cradleServo.write(currentPos - 1);
-            } else {
-                // Completed one part of the cycle, check if more cycles are needed
-                swingCycles--;
-                if (swingCycles > 0) {
-                    cradleState = SWINGING_FORWARD;
-                } else {
-                    cradleState = RETURNING; // All cycles done, return to rest
-                }
-            }
-            break;
-            
-        case RETURNING:
-            if (currentPos < CRADLE_POS_REST) {
-                cradleServo.write(currentPos + 1);
-            } else if (currentPos > CRADLE_POS_REST) {
-                cradleServo.write(currentPos - 1);
-            } else {
-                cradleState = IDLE; // Returned to rest position
-                Serial.println("Cradle stopped.");
-                lcd.setCursor(0, 1);
-                lcd.print("                "); // Clear cradle message line
-            }
-            break;
+void halDhtListen() {
+    pinMode(DHT_PIN, INPUT_PULLUP);
+    attachInterrupt(DHT_PIN, dhtEdgeISR, FALLING);
+}
+
+void halDhtStop() {
+    detachInterrupt(DHT_PIN);
+}
+
+ResetCause halResetCause() {
+    switch (esp_reset_reason()) {
+    case ESP_RST_SW:                // Our own esp_restart(), and the core's
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_PANIC:
+        return RESET_WATCHDOG;
+    case ESP_RST_BROWNOUT:
+        return RESET_BROWNOUT;
+    case ESP_RST_EXT:
+        return RESET_EXTERNAL;
+    case ESP_RST_UNKNOWN:
+        return RESET_UNKNOWN;
+    default:
+        return RESET_POWER_ON;
     }
 }
 
-void startBuzzer(BuzzerMode mode, int count) {
-    if (isBuzzerActive) return; // Don't start a new pattern if one is running
-    buzzerMode = mode;
-    beepCount = count * 2; // Each beep is an ON and OFF state
-    buzzerPatternStartTime = millis();
-    isBuzzerActive = true;
+// Software watchdog: each core's scheduler loop feeds its own slot and the
+// tick task resets if either goes quiet, after watchdogExpired() has recorded
+// the hung task
+void halWatchdogStart() {
+    for (byte core = 0; core < HAL_CORES; core++) watchdogFeedTime[core] = millis();
+    watchdogRunning = true;
+}
+
+void halWatchdogFeed() {
+    watchdogFeedTime[xPortGetCoreID()] = millis();
+}
+
+void halReset() {
+    esp_restart();
 }
 
-void manageBuzzer(unsigned long currentTime) {
-    if (!isBuzzerActive) return;
+#if ENABLE_PROFILING
+// Task stacks live in the heap, so there is no gap to paint: the core keeps the low-water mark
+void halPaintFreeSRAM() {
+}
+
+int halFreeSRAM() {
+    return ESP.getFreeHeap();
+}
+
+int halFreeSRAMLowWater() {
+    return ESP.getMinFreeHeap();
+}
+#endif
+#else
+#if BOARD == BOARD_MEGA
+#define OC2B_PIN 9
+#else
+#define OC2B_PIN 3
+#endif
+static_assert(digitalPinToInterrupt(DHT_PIN) != NOT_AN_INTERRUPT, "DHT_PIN needs an external interrupt");
+static_assert(!FAN_PWM || FAN_RELAY_PIN == OC2B_PIN, "FAN_PWM drives the fan from OC2B");
+static_assert(SOIL_SENSOR_PIN >= A0 && SOIL_SENSOR_PIN <= A7, "SOIL_SENSOR_PIN must be an analog input");
+
+// Pin drivers: every pin is its own type, so the port register and bit mask
+// are fixed at compile time and an access compiles to a single sbi/cbi/sbis
+// instead of digitalWrite()'s table lookups (a few microseconds each). The
+// single-instruction forms are atomic, which is what lets the tick ISR and the
+// loop share the buzzer pin. Boards other than the ATmega328P use the Arduino calls.
+enum PinPolarity { ActiveHigh, ActiveLow };
 
-    unsigned long onDuration, offDuration;
-    if (buzzerMode == CRY_ALERT) {
-        onDuration = 200; offDuration = 200; // Fast beep
-    } else { // WET_ALERT
-        onDuration = 500; offDuration = 500; // Slow beep
+template <byte PIN>
+struct FastPin {
+#if defined(__AVR_ATmega328P__)
+    static_assert(PIN < 20, "FastPin covers D0-D13 and A0-A5 on the ATmega328P");
+    static const byte MASK = 1 << (PIN < 8 ? PIN : PIN < 14 ? PIN - 8 : PIN - 14);
+    static volatile uint8_t& port() { return PIN < 8 ? PORTD : PIN < 14 ? PORTB : PORTC; }
+    static volatile uint8_t& ddr() { return PIN < 8 ? DDRD : PIN < 14 ? DDRB : DDRC; }
+    static volatile uint8_t& in() { return PIN < 8 ? PIND : PIN < 14 ? PINB : PINC; }
+    static void output() { ddr() |= MASK; }
+    static void input(bool pullup) {
+        ddr() &= ~MASK;
+        if (pullup) port() |= MASK; else port() &= ~MASK;
     }
+    static void high() { port() |= MASK; }
+    static void low() { port() &= ~MASK; }
+    static void toggle() { in() = MASK; } // Writing a 1 to PINx flips the output latch
+    static bool read() { return (in() & MASK) != 0; }
+#else
+    static void output() { pinMode(PIN, OUTPUT); }
+    static void input(bool pullup) { pinMode(PIN, pullup ? INPUT_PULLUP : INPUT); }
+    static void high() { digitalWrite(PIN, HIGH); }
+    static void low() { digitalWrite(PIN, LOW); }
+    static void toggle() { digitalWrite(PIN, !digitalRead(PIN)); }
+    static bool read() { return digitalRead(PIN) == HIGH; }
+#endif
+};
 
-    unsigned long elapsedTime = currentTime - buzzerPatternStartTime;
-    
-    if (beepCount > 0) {
-        // Check if we are in an ON or OFF part of the beep cycle
-        if ( (elapsedTime % (onDuration + offDuration)) < onDuration ) {
-            digitalWrite(BUZZER_PIN, HIGH); // Beep ON
-        } else {
-            digitalWrite(BUZZER_PIN, LOW); // Beep OFF
-        }
-        
-        // Decrement beepCount at the end of each full cycle
-        if (elapsedTime >= onDuration + offDuration) {
-            beepCount -= 2; // One ON and one OFF state finished
-            buzzerPatternStartTime = currentTime; // Reset timer for the next beep
-        }
+template <byte PIN, PinPolarity POLARITY = ActiveHigh>
+struct DigitalOut {
+    static void begin() { set(false); FastPin<PIN>::output(); } // Latch the idle level before driving
+    static void set(bool on) {
+        if (on != (POLARITY == ActiveLow)) FastPin<PIN>::high(); else FastPin<PIN>::low();
+    }
+    static void toggle() { FastPin<PIN>::toggle(); }
+};
+
+template <byte PIN, PinPolarity POLARITY = ActiveLow>
+struct Relay : DigitalOut<PIN, POLARITY> {
+    static void on() { DigitalOut<PIN, POLARITY>::set(true); }
+    static void off() { DigitalOut<PIN, POLARITY>::set(false); }
+};
+
+template <byte PIN, PinPolarity POLARITY = ActiveHigh>
+struct DigitalIn {
+    static void begin(bool pullup = false) { FastPin<PIN>::input(pullup); }
+    static bool isActive() { return FastPin<PIN>::read() != (POLARITY == ActiveLow); }
+};
+
+#if FAN_PWM
+typedef DigitalOut<FAN_RELAY_PIN> FanOutput;        // MOSFET gate, driven by OC2B while PWM is on
+#else
+typedef Relay<FAN_RELAY_PIN, ActiveLow> FanOutput;
+#endif
+typedef DigitalOut<BUZZER_PIN> BuzzerOutput;
+typedef DigitalIn<SOUND_SENSOR_PIN, SOUND_ACTIVE == LOW ? ActiveLow : ActiveHigh> SoundInput;
+typedef DigitalIn<SOIL_SENSOR_PIN> SoilInput;
+typedef FastPin<DHT_PIN> DhtLine;
+
+unsigned long halMillis() {
+    return millis();
+}
+
+unsigned long halMicros() {
+    return micros();
+}
+
+void halStartSerial(unsigned long gsmBaud) {
+#if GSM_PORT != GSM_PORT_SERIAL
+    Serial.begin(9600);
+#endif
+    gsmPort.begin(gsmBaud);
+}
+
+void halGsmBegin(unsigned long baud) {
+    gsmPort.begin(baud);
+}
+
+void halStartPins() {
+    FanOutput::begin();
+    BuzzerOutput::begin();
+    SoilInput::begin();
+    SoundInput::begin();
+}
+
+bool halSoundActive() {
+    return SoundInput::isActive();
+}
+
+void halSetBuzzer(bool on) {
+    BuzzerOutput::set(on);
+}
+
+void halToggleBuzzer() {
+    BuzzerOutput::toggle();
+}
+
+void halWriteFan(byte duty) {
+#if FAN_PWM
+    if (duty == 0) {
+        TCCR2A &= ~(1 << COM2B1); // Disconnect OC2B: even OCR2B = 0 leaves a spike per period
+        FanOutput::set(false);
     } else {
-        // Pattern finished
-        digitalWrite(BUZZER_PIN, LOW);
-        isBuzzerActive = false;
-        buzzerMode = OFF;
+        OCR2B = (unsigned int)duty * (OCR2A + 1) / 100 - 1;
+        TCCR2A |= (1 << COM2B1);
     }
+#else
+    FanOutput::set(duty > 0);
+#endif
 }
 
+void halServoAttach(byte degrees) {
+    cradleServo.attach(SERVO_PIN);
+    cradleServo.write(degrees);
+}
 
-void manageDiaperAlertMessage(unsigned long currentTime) {
-    // If the alert is active and has been for more than 5 seconds, clear it
-    if (isDiaperAlertActive && (currentTime - diaperAlertStartTime > 5000)) {
-        isDiaperAlertActive = false;
-        // The LCD update function will clear the message automatically
+void halServoWrite(byte degrees) {
+    cradleServo.write(degrees);
+}
+
+// Every I2C transfer gives up after LCD_I2C_TIMEOUT instead of waiting forever
+// on a bus held low (Wire timeouts need AVR core 1.8.3 or later)
+#define LCD_I2C_TIMEOUT 3000        // us per transfer; a healthy one takes ~300 us at 100 kHz
+void halLcdBegin() {
+    Wire.begin();
+    Wire.setWireTimeout(LCD_I2C_TIMEOUT, true); // Also resets the TWI hardware on a timeout
+    lcd.begin(LCD_COLS, LCD_ROWS);
+    lcd.backlight();
+}
+
+// True if an I2C transfer timed out since the last call
+bool halLcdTimedOut() {
+    bool timedOut = Wire.getWireTimeoutFlag();
+    Wire.clearWireTimeoutFlag();
+    return timedOut;
+}
+
+void halStartStorage() {
+}
+
+bool halEepromReady() {
+    return eeprom_is_ready();
+}
+
+byte halEepromRead(int address) {
+    return EEPROM.read(address);
+}
+
+void halEepromWrite(int address, byte value) {
+    EEPROM.write(address, value);
+}
+
+void halEepromCommit() {
+}
+
+void halIdle() {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+}
+
+void halPowerDownUnused() {
+    power_spi_disable();  // SPI is unused; Timer1 (Servo), TWI, USART and ADC stay on
+    ACSR = bit(ACD);      // Analog comparator off
+}
+
+void halStartTick() {
+#if FAN_PWM
+    // Timer2 in fast PWM with TOP = OCR2A: still 16 MHz / 64 / 250 = 1 kHz, and
+    // OC2B (the fan pin) gives the fan a 1 kHz PWM for free
+    TCCR2A = (1 << WGM21) | (1 << WGM20);
+    TCCR2B = (1 << WGM22) | (1 << CS22);
+#else
+    // Timer2 in CTC mode: 16 MHz / 64 / 250 = 1 kHz
+    TCCR2A = (1 << WGM21);
+    TCCR2B = (1 << CS22);
+#endif
+    OCR2A = 249;
+    TCNT2 = 0;
+    TIMSK2 |= (1 << OCIE2A);
+}
+
+ISR(TIMER2_COMPA_vect) {
+    timerTick();
+}
+
+void halStartSoilADC() {
+    DIDR0 |= (1 << (SOIL_SENSOR_PIN - A0));       // No digital input buffer on the probe pin
+    ADMUX = (1 << REFS0) | (SOIL_SENSOR_PIN - A0); // AVcc reference, soil channel
+    ADCSRB = (1 << ADTS2);                        // Auto-trigger on Timer0 overflow
+    ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE)
+           | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0); // 125 kHz ADC clock
+}
+
+ISR(ADC_vect) {
+    addSoilReading(ADC);
+}
+
+// DHT data line: drive the start pulse, then listen for falling edges
+void halDhtStart() {
+    DhtLine::low();
+    DhtLine::output();
+}
+
+void halDhtListen() {
+    DhtLine::input(true);
+    EIFR = bit(digitalPinToInterrupt(DHT_PIN)); // Drop any edge latched while driving
+    attachInterrupt(digitalPinToInterrupt(DHT_PIN), dhtEdgeISR, FALLING);
+}
+
+void halDhtStop() {
+    detachInterrupt(digitalPinToInterrupt(DHT_PIN));
+}
+
+// MCUSR has to be read and the watchdog stopped before main(): a watchdog
+// reset leaves it running, and it would expire again during setup().
+// Optiboot clears MCUSR itself and hands the old value over in r2 instead.
+#define WATCHDOG_TIMEOUT WDTO_2S    // Far above any task's budget, below a user's patience
+byte resetFlags __attribute__((section(".noinit")));
+void captureResetFlags() __attribute__((naked, used, section(".init3")));
+void captureResetFlags() {
+    byte bootloaderFlags;
+    asm volatile("mov %0, r2" : "=r"(bootloaderFlags)); // Nothing before .init3 touches r2
+    resetFlags = MCUSR;
+    if (resetFlags == 0) resetFlags = bootloaderFlags;
+    MCUSR = 0;
+    wdt_disable();
+}
+
+ResetCause halResetCause() {
+    if (resetFlags & (1 << WDRF)) return RESET_WATCHDOG;
+    if (resetFlags & (1 << BORF)) return RESET_BROWNOUT;
+    if (resetFlags & (1 << EXTRF)) return RESET_EXTERNAL;
+    if (resetFlags & (1 << PORF)) return RESET_POWER_ON;
+    return RESET_UNKNOWN;
+}
+
+// Interrupt-then-reset mode: the first expiry runs WDT_vect, which records the
+// hung task before resetting
+void halWatchdogStart() {
+    wdt_enable(WATCHDOG_TIMEOUT);
+    WDTCSR |= (1 << WDIE);
+}
+
+void halWatchdogFeed() {
+    wdt_reset();
+}
+
+void halReset() {
+    wdt_enable(WDTO_15MS);
+    for (;;) {
     }
 }
 
+ISR(WDT_vect) {
+    watchdogExpired();
+}
+
+#if ENABLE_PROFILING
+#define SRAM_PAINT 0xA5             // Fill pattern for the stack low-water mark
+extern char __heap_start;
+extern char* __brkval;
 
-// --- DISPLAY FUNCTION ---
-void updateLCD(float temperature) {
-    // Line 0: Temperature and Fan Status
-    lcd.setCursor(0, 0);
-    lcd.print("Temp: ");
-    lcd.print(temperature, 1); // Temperature with 1 decimal place
-    lcd.print("C  ");
+char* heapEnd() {
+    return __brkval != NULL ? __brkval : &__heap_start;
+}
 
-    lcd.setCursor(11, 0);
-    lcd.print(digitalRead(FAN_RELAY_PIN) == LOW ? "F:ON " : "F:OFF");
+// Fills the gap between heap and stack so the deepest stack use can be found later
+void halPaintFreeSRAM() {
+    char top;
+    for (char* p = heapEnd(); p < &top - 16; p++) *p = SRAM_PAINT;
+}
 
-    // Line 1: Status Messages
-    lcd.setCursor(0, 1);
-    if (cradleState != IDLE) {
-        lcd.print("Cradle Swinging ");
-    } else if (isDiaperAlertActive) {
-        lcd.print("Diaper is Wet!  ");
+int halFreeSRAM() {
+    char top;
+    return &top - heapEnd();
+}
+
+int halFreeSRAMLowWater() {
+    char top;
+    char* p = heapEnd();
+    while (p < &top && *p == (char)SRAM_PAINT) p++;
+    return p - heapEnd();
+}
+#endif
+#endif
+
+#if !HAL_HOST
+// The same on every board
+void halLcdBacklight(bool on) {
+    if (on) {
+        lcd.backlight();
     } else {
-        lcd.print("System OK       ");
+        lcd.noBacklight();
     }
 }
 
-// --- GSM FUNCTIONS ---
-void initializeGSM() {
-    Serial.println("Initializing GSM Module...");
-    // Give the module some time to boot
-    delay(3000);
-    
-    for (int i = 0; i < 5; i++) {
-        gsm.println("AT");
-        delay(1000);
-        
-        while (gsm.available()) {
-            if (gsm.readString().indexOf("OK") != -1) {
-                Serial.println("GSM Module Initialized Successfully!");
-                gsm.println("AT+CMGF=1"); // Set to text mode
-                delay(500);
-                return;
-            }
+void halLcdSetCursor(byte col, byte row) {
+    lcd.setCursor(col, row);
+}
+
+void halLcdWrite(char c) {
+    lcd.write(c);
+}
+
+// A slave reset mid-byte can hold SDA low forever: clock it out with up to nine
+// SCL pulses, send a STOP, then start the bus and the display again
+void halLcdRecover() {
+    Wire.end();
+    pinMode(SDA, INPUT_PULLUP);
+    pinMode(SCL, INPUT_PULLUP);
+    for (byte i = 0; i < 9 && digitalRead(SDA) == LOW; i++) {
+        digitalWrite(SCL, LOW); // Open drain: drive low, release to the pull-up
+        pinMode(SCL, OUTPUT);
+        delayMicroseconds(5);
+        pinMode(SCL, INPUT_PULLUP);
+        delayMicroseconds(5);
+    }
+    digitalWrite(SDA, LOW);     // STOP: SDA rises while SCL is high
+    pinMode(SDA, OUTPUT);
+    delayMicroseconds(5);
+    pinMode(SDA, INPUT_PULLUP);
+    delayMicroseconds(5);
+    halLcdBegin();
+}
+#endif
+
+// --- SETUP FUNCTION ---
+void setup() {
+#if ENABLE_PROFILING
+    halPaintFreeSRAM();
+    resetProfile();
+#endif
+    halStartSerial(gsmBaud);
+    halStartStorage();
+    loadConfig();
+
+    halLcdBegin();
+    memset(lcdShown, ' ', sizeof(lcdShown)); // begin() leaves the display cleared
+    memset(lcdFrame, ' ', sizeof(lcdFrame));
+    lcdShowMessage(0, MSG_LCD_SPLASH);
+
+    halStartPins(); // Fan OFF and buzzer silent initially
+    halServoAttach(config.posRest);
+    halStartTick();
+    halStartSoilADC();
+    startPowerSaving();
+    readResetCause();
+    startEventLog();
+    reportResetCause();
+
+    // The GSM module is brought up in the background by manageGSM(), so monitoring
+    // starts immediately, and the self-test runs alongside. The splash stays until
+    // the first LCD update replaces it.
+    logMessage(MSG_SYSTEM_READY);
+    startSelfTest();
+    startWatchdog();
+#if HAL_CORES > 1
+    halStartRadioCore();
+#endif
+}
+
+// --- MAIN LOOP ---
+#if HAL_CORES > 1
+void loop() {
+    runScheduler(ALL_TASKS & ~RADIO_TASKS);
+}
+
+// Loop of the second core, started by halStartRadioCore()
+void radioLoop() {
+    runScheduler(RADIO_TASKS);
+}
+#else
+void loop() {
+    runScheduler(ALL_TASKS);
+}
+#endif
+
+// --- CORE LOGIC FUNCTIONS ---
+// Detectors turn filtered sensor state into events; they do not touch actuators.
+// Sound in the window as ms of activity. Onsets are weighted so that either
+// detection limit on its own gives the same level: CRY_MIN_ACTIVE_MS.
+unsigned int soundLevel(unsigned int edges, unsigned int activeMs) {
+    return max(activeMs, edges * (CRY_MIN_ACTIVE_MS / CRY_MIN_EDGES));
+}
+
+// 0-255 by how much of the window holds sound
+byte soundIntensity(unsigned int edges, unsigned int activeMs) {
+    unsigned long level = soundLevel(edges, activeMs);
+    return min(level * 255 / (CRY_WINDOW_BINS * CRY_BIN_MS), 255UL);
+}
+
+// The room's calibrated background sound raises both limits alike
+void detectCry(unsigned int edges, unsigned int activeMs, unsigned long currentTime) {
+    if (soundLevel(edges, activeMs) >= CRY_MIN_ACTIVE_MS + (unsigned int)config.soundFloor) {
+        lastCryActivityTime = currentTime;
+        if (!isCrying) {
+            isCrying = true;
+            publishEvent(EVT_CRY_START, activeMs);
         }
-        Serial.println("Retrying GSM Connection...");
+    } else if (isCrying && currentTime - lastCryActivityTime > CRY_QUIET_TIME) {
+        isCrying = false;
+        publishEvent(EVT_CRY_END, 0);
+    }
+}
+
+void detectOverheat(float heatIndex) {
+    if (heatIndex > config.criticalTemperature && !isOverheated) {
+        isOverheated = true;
+        publishEvent(EVT_HEAT, (int)(heatIndex * 10));
+    } else if (heatIndex < config.criticalTemperature - HEAT_ALERT_HYSTERESIS && isOverheated) {
+        isOverheated = false;
+        publishEvent(EVT_HEAT_OK, (int)(heatIndex * 10));
+    }
+}
+
+void detectWetness(int soilValue) {
+    // Hysteresis: report wet once, then stay latched until the reading is dry
+    if (soilValue < config.wetnessThreshold && !isDiaperAlertActive) {
+        isDiaperAlertActive = true;
+        publishEvent(EVT_WET, soilValue);
+    } else if (soilValue > config.drynessThreshold && isDiaperAlertActive) {
+        isDiaperAlertActive = false;
+        publishEvent(EVT_DRY, soilValue);
     }
-    Serial.println("GSM Module Initialization Failed!");
 }
 
-void sendSMS(const char* number, const char* message) {
-    Serial.print("Sending SMS to ");
-    Serial.println(number);
+// --- EVENT SUBSCRIBERS ---
+void fanOnEvent(const Event& event) {
+    handleTemperature(event.value / 10.0);
+}
 
-    // This function is blocking due to the delays required for GSM communication.
-    // It will cause a brief pause in the main loop's responsiveness.
-    gsm.print("AT+CMGS=\"");
-    gsm.print(number);
-    gsm.println("\"");
-    delay(1000);
+// Takes the heat index rather than the dry temperature, so humid air starts the
+// fan sooner and dry air later than the threshold alone would
+void handleTemperature(float temperature) {
+    if (fanOverride != FAN_AUTO && halMillis() - fanOverrideTime >= FAN_OVERRIDE_TIME) {
+        fanOverride = FAN_AUTO;
+    }
+    if (fanOverride != FAN_AUTO) return;
+
+    // Hysteresis stops a reading that jitters around the threshold from
+    // chattering the relay; the dwell time caps how often it can switch at all
+    float offBelow = config.temperatureThreshold - config.fanHysteresis;
+    bool fanOn = isFanOn ? temperature > offBelow : temperature > config.temperatureThreshold;
+    if (fanOn != isFanOn && halMillis() - fanSwitchTime < FAN_MIN_DWELL) fanOn = isFanOn;
+    setFan(fanOn, fanSpeed(temperature), temperature);
+}
 
-    gsm.print(message);
-    delay(100);
+byte fanSpeed(float temperature) {
+#if FAN_PWM
+    float above = temperature - config.temperatureThreshold;
+    int duty = FAN_PWM_MIN_DUTY + above * (100 - FAN_PWM_MIN_DUTY) / FAN_PWM_FULL_SPAN;
+    return constrain(duty, FAN_PWM_MIN_DUTY, 100);
+#else
+    return 100;
+#endif
+}
 
-    gsm.write(26); // ASCII for Ctrl+Z to send the message
-    delay(1000);
+// Forces the fan on or off for FAN_OVERRIDE_TIME, then automatic control resumes
+void overrideFan(FanOverride mode) {
+    fanOverride = mode;
+    fanOverrideTime = halMillis();
+    if (mode != FAN_AUTO) setFan(mode == FAN_FORCED_ON, 100, lastTemperature);
+}
 
-    Serial.println("SMS Sent Command Issued!");
-}
\ No newline at end of file
+void setFan(bool fanOn, byte duty, float temperature) {
+    fanDuty = fanOn ? duty : 0;
+    halWriteFan(fanDuty);
+    if (fanOn != isFanOn) {
+        isFanOn = fanOn;
+        fanSwitchTime = halMillis();
+        logEvent(fanOn ? LOG_FAN_ON : LOG_FAN_OFF, isnan(temperature) ? 0 : constrain((int)temperature, 0, 255));
+    }
+}
+
+void cradleOnEvent(const Event& event) {
+    // Also while a swing is running or winding down: soothing takes it over
+    startSoothing();
+}
+
+void alertOnEvent(const Event& event) {
+    switch (event.type) {
+        case EVT_CRY_START: raiseAlert(ALERT_CRY); break;
+        case EVT_WET:       raiseAlert(ALERT_WET); break;
+        case EVT_HEAT:      raiseAlert(ALERT_HEAT); break;
+        case EVT_CRY_END:   resolveAlert(ALERT_CRY); break;
+        case EVT_DRY:       resolveAlert(ALERT_WET); break;
+        case EVT_HEAT_OK:   resolveAlert(ALERT_HEAT); break;
+    }
+}
+
+void trendOnEvent(const Event& event) {
+    unsigned long now = halMillis();
+    switch (event.type) {
+        case EVT_CRY_START:
+            trendIntervalCries++;
+            trendCryStartTime = now;
+            break;
+        case EVT_CRY_END:
+            trendIntervalCryTime += now - trendCryStartTime;
+            break;
+        case EVT_WET:
+            trendIntervalWet = true;
+            break;
+    }
+}
+
+void displayOnEvent(const Event& event) {
+    // Show the new state now instead of at the next periodic refresh
+    taskUpdateDisplay(halMillis());
+}
+
+void loggerOnEvent(const Event& event) {
+    switch (event.type) {
+        case EVT_CRY_START:
+            logMessage(MSG_CRY_ALERT);
+            logEvent(LOG_CRY_START, min(event.value / 2, 255));
+            break;
+        case EVT_CRY_END:
+            logMessage(MSG_CRY_STOPPED);
+            logEvent(LOG_CRY_END, 0);
+            break;
+        case EVT_WET:
+            logMessage(MSG_WET_ALERT);
+            logEvent(LOG_WET, event.value / 4);
+            break;
+        case EVT_DRY:
+            logMessage(MSG_DIAPER_DRY);
+            logEvent(LOG_DRY, event.value / 4);
+            break;
+        case EVT_HEAT:
+            logMessage(MSG_HEAT_ALERT);
+            logEvent(LOG_HOT, constrain(event.value / 10, 0, 255));
+            break;
+        case EVT_HEAT_OK:
+            logMessage(MSG_HEAT_OK);
+            logEvent(LOG_COOL, constrain(event.value / 10, 0, 255));
+            break;
+    }
+}
+
+// Subscribers run in table order for each event
+#define ALERT_EVENTS (EVENT_BIT(EVT_CRY_START) | EVENT_BIT(EVT_CRY_END) | EVENT_BIT(EVT_WET) | EVENT_BIT(EVT_DRY) \
+                      | EVENT_BIT(EVT_HEAT) | EVENT_BIT(EVT_HEAT_OK))
+const Subscriber SUBSCRIBERS[] PROGMEM = {
+    { EVENT_BIT(EVT_TEMP_SAMPLE), fanOnEvent },
+    { EVENT_BIT(EVT_CRY_START), cradleOnEvent },
+    { ALERT_EVENTS, alertOnEvent },
+    { EVENT_BIT(EVT_CRY_START) | EVENT_BIT(EVT_WET) | EVENT_BIT(EVT_DRY) | EVENT_BIT(EVT_HEAT) | EVENT_BIT(EVT_HEAT_OK),
+      displayOnEvent },
+    { ALERT_EVENTS, loggerOnEvent },
+    { EVENT_BIT(EVT_CRY_START) | EVENT_BIT(EVT_CRY_END) | EVENT_BIT(EVT_WET), trendOnEvent },
+};
+#define SUBSCRIBER_COUNT (sizeof(SUBSCRIBERS) / sizeof(SUBSCRIBERS[0]))
+
+// --- ACTION MANAGEMENT FUNCTIONS (Non-Blocking) ---
+
+void startSoothing() {
+    isSoothing = true;
+    if (cryIntensity > sootheLevel) sootheLevel = cryIntensity;
+    sootheAmplitude = 0; // Retune even if the amplitude is unchanged
+    tuneSoothing();
+}
+
+// Closed loop on cry intensity, run from taskCradle
+void manageSoothing(unsigned long currentTime) {
+    if (!isSoothing) return;
+    if (!isCrying && currentTime - lastCryActivityTime >= config.quietTime * 1000UL) {
+        isSoothing = false;
+        sootheLevel = 0;
+        stopSwing();
+        logMessage(MSG_BABY_SETTLED);
+        return;
+    }
+    // A louder cry swings harder at once; softer crying lets the swing taper off
+    if (cryIntensity >= sootheLevel) {
+        sootheLevel = cryIntensity;
+    } else {
+        sootheLevel = max(sootheLevel - SOOTHE_RELEASE_STEP, (int)cryIntensity);
+    }
+    tuneSoothing();
+}
+
+// Maps sootheLevel onto SOOTHE_MIN_AMPLITUDE .. the full swing out to config.posMax
+void tuneSoothing() {
+    byte fullAmplitude = config.posMax - config.posRest;
+    byte lowAmplitude = min(SOOTHE_MIN_AMPLITUDE, fullAmplitude);
+    byte amplitude = lowAmplitude + (unsigned int)(fullAmplitude - lowAmplitude) * sootheLevel / 255;
+    // A swing that ended on its own (a SWING command's cycles) is restarted too
+    if (isCradleSwinging() && abs(amplitude - sootheAmplitude) < SOOTHE_RETUNE_STEP) return;
+    sootheAmplitude = amplitude;
+    startSwing(amplitude, 4UL * amplitude * config.swingSpeed, 0);
+}
+
+// The motion itself runs in motionTickISR(); this only reports the end of a swing
+void manageCradleSwing(unsigned long currentTime) {
+    if (!motionStopped) return;
+    motionStopped = false;
+    logMessage(MSG_CRADLE_STOPPED);
+    lcdClearLine(1); // Clear cradle message line
+}
+
+// --- TASKS ---
+void taskReadTemperature(unsigned long currentTime) {
+    float temperature, humidity;
+    if (!readDHT(currentTime, temperature, humidity)) return;
+
+    // Only proceed if temperature reading is valid
+    if (!isnan(temperature)) {
+        lastTemperature = temperature;
+        lastHumidity = humidity;
+        lastHeatIndex = heatIndex(temperature, humidity);
+        lastTemperatureTime = currentTime;
+        publishEvent(EVT_TEMP_SAMPLE, (int)(lastHeatIndex * 10));
+        detectOverheat(lastHeatIndex);
+    }
+}
+
+#if ENABLE_TELEMETRY
+void taskTelemetry(unsigned long currentTime) {
+    TelemetrySample sample;
+    bool fresh = !isnan(lastTemperature) && currentTime - lastTemperatureTime <= DHT_STALE_TIME;
+    sample.values[FIELD_TEMPERATURE] = fresh ? (int)(lastTemperature * 10) : TELEMETRY_NO_READING;
+    sample.values[FIELD_HUMIDITY] = fresh ? (int)lastHumidity : TELEMETRY_NO_READING;
+    sample.values[FIELD_SOIL] = TELEMETRY_NO_READING;
+    if (soilFilterReady) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            sample.values[FIELD_SOIL] = soilFilterState >> SOIL_FILTER_SHIFT;
+        }
+    }
+    sample.values[FIELD_SOUND] = telemetrySoundPeak / 2;
+    telemetrySoundPeak = 0;
+    sample.values[FIELD_FLAGS] = (isCrying ? TELEMETRY_FLAG_CRYING : 0)
+                               | (isDiaperAlertActive ? TELEMETRY_FLAG_WET : 0)
+                               | (isFanOn ? TELEMETRY_FLAG_FAN : 0)
+                               | (isCradleSwinging() ? TELEMETRY_FLAG_SWINGING : 0)
+                               | (isOverheated ? TELEMETRY_FLAG_HOT : 0);
+
+    if (telemetrySending) {
+        // The frame's length is already with the modem: add this one after it
+        telemetryPending = sample;
+        telemetryPendingTime = currentTime;
+        telemetryPendingValid = true;
+        return;
+    }
+    addTelemetrySample(sample, currentTime);
+}
+#endif
+
+void taskSampleSound(unsigned long currentTime) {
+    unsigned int edges, activeMs;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        edges = windowEdges;
+        activeMs = windowActiveMs;
+    }
+#if ENABLE_TELEMETRY
+    if (activeMs > telemetrySoundPeak) telemetrySoundPeak = activeMs;
+#endif
+    cryIntensity = soundIntensity(edges, activeMs);
+    detectCry(edges, activeMs, currentTime);
+}
+
+void taskSampleSoil(unsigned long currentTime) {
+    if (!soilFilterReady || (selfTestCalibrating & CALIBRATED_SOIL)) return; // No thresholds yet
+    unsigned int filterState;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        filterState = soilFilterState;
+    }
+    detectWetness(filterState >> SOIL_FILTER_SHIFT);
+}
+
+void taskCradle(unsigned long currentTime) {
+    manageSoothing(currentTime);
+    manageCradleSwing(currentTime);
+}
+
+// Closes the interval being collected once TREND_INTERVAL has passed
+void taskTrend(unsigned long currentTime) {
+    if (currentTime - trendIntervalStart < TREND_INTERVAL) return;
+    trendIntervalStart = currentTime;
+    if (isCrying) {
+        // Split an episode still going on between this interval and the next
+        trendIntervalCryTime += currentTime - trendCryStartTime;
+        trendCryStartTime = currentTime;
+    }
+    bool fresh = currentTime - lastTemperatureTime <= DHT_STALE_TIME;
+    addTrendSample(fresh ? lastTemperature : NAN, trendIntervalCries, trendIntervalWet || isDiaperAlertActive,
+                   trendIntervalCryTime);
+    trendIntervalCries = 0;
+    trendIntervalCryTime = 0;
+    trendIntervalWet = false;
+}
+
+void taskSelfTest(unsigned long currentTime) {
+    if (selfTestState == SELFTEST_SENSORS) {
+        sampleSelfTest(currentTime);
+        if (currentTime - selfTestStartTime >= SELFTEST_TIME) finishSensorTest();
+    } else if (selfTestState == SELFTEST_MODEM) {
+        if (gsmState < GSM_OFFLINE) return; // Still coming up
+        if (gsmState == GSM_OFFLINE) selfTestFaults |= FAULT_MODEM;
+        finishSelfTest();
+    }
+}
+
+void taskEvents(unsigned long currentTime) {
+    dispatchEvents();
+}
+
+void taskGSM(unsigned long currentTime) {
+    manageAlertQueue(currentTime);
+    manageGSM(currentTime);
+}
+
+void taskFlushLCD(unsigned long currentTime) {
+    manageLCD();
+}
+
+void taskConsole(unsigned long currentTime) {
+    manageSerialConsole();
+    manageLogDump();
+#if ENABLE_PROFILING && PROFILE_REPORT_INTERVAL > 0
+    if (currentTime - lastProfileReportTime >= PROFILE_REPORT_INTERVAL) {
+        lastProfileReportTime = currentTime;
+        printProfileReport();
+    }
+#endif
+}
+
+void taskPower(unsigned long currentTime) {
+    managePower(currentTime);
+}
+
+void taskStorage(unsigned long currentTime) {
+    manageEeprom();
+    manageConfig();
+    manageEventLog(currentTime);
+}
+
+void taskUpdateDisplay(unsigned long currentTime) {
+    // A DHT that never answers still gets the self-test result shown
+    if (!isnan(lastTemperature) || selfTestState != SELFTEST_SENSORS) updateLCD(currentTime);
+}
+
+// --- EVENT BUS ---
+// No locks: each index is written by one side only, and the slot is filled
+// before the release store of eventHead makes it visible. That holds for one
+// producer context. Today that is the tasks, which run one at a time on either
+// core; an ISR could take the producer side over, but tasks and an ISR must
+// not both publish. Only dispatchEvents() consumes.
+void publishEvent(EventType type, int value) {
+    byte head = eventHead;
+    byte next = (head + 1) & (EVENT_QUEUE_SIZE - 1);
+    if (next == __atomic_load_n(&eventTail, __ATOMIC_ACQUIRE)) {
+        eventsDropped++; // Queue full: the newest event is lost
+        return;
+    }
+    eventQueue[head].type = type;
+    eventQueue[head].value = value;
+    __atomic_store_n(&eventHead, next, __ATOMIC_RELEASE);
+}
+
+// Hands up to EVENT_BATCH queued events to every subscriber of their type
+void dispatchEvents() {
+    for (byte n = 0; n < EVENT_BATCH; n++) {
+        byte tail = eventTail;
+        if (tail == __atomic_load_n(&eventHead, __ATOMIC_ACQUIRE)) break;
+        Event event = eventQueue[tail];
+        // The copy is taken before the slot is handed back to the producer
+        __atomic_store_n(&eventTail, (byte)((tail + 1) & (EVENT_QUEUE_SIZE - 1)), __ATOMIC_RELEASE);
+
+        for (byte i = 0; i < SUBSCRIBER_COUNT; i++) {
+            const Subscriber* subscriber = &SUBSCRIBERS[i];
+            if (pgm_read_word(&subscriber->eventMask) & EVENT_BIT(event.type)) {
+                void (*handle)(const Event&) = (void (*)(const Event&))pgm_read_ptr(&subscriber->handle);
+                handle(event);
+            }
+        }
+    }
+}
+
+// --- TIMER TICK (1 kHz) ---
+void timerTick() {
+    sampleSoundISR();
+    motionTickISR();
+    buzzerTickISR();
+}
+
+// Called every 1 ms. Bins the sound sensor and keeps the window sums up to date
+// in O(1), so the detector task only has to read two counters.
+void sampleSoundISR() {
+    bool active = halSoundActive();
+    if (active) {
+        currentSoundBin.activeMs++;
+        if (!wasSoundActive) currentSoundBin.edges++;
+    }
+    wasSoundActive = active;
+
+    if (++soundBinTicks < CRY_BIN_MS) return;
+    soundBinTicks = 0;
+
+    volatile SoundBin& oldest = soundBins[soundBinIndex];
+    windowEdges += currentSoundBin.edges - oldest.edges;
+    windowActiveMs += currentSoundBin.activeMs - oldest.activeMs;
+    oldest.edges = currentSoundBin.edges;
+    oldest.activeMs = currentSoundBin.activeMs;
+    soundBinIndex = (soundBinIndex + 1) % CRY_WINDOW_BINS;
+    currentSoundBin.edges = 0;
+    currentSoundBin.activeMs = 0;
+}
+
+// --- CRADLE MOTION ENGINE ---
+// Starts or retunes a swing: amplitude in degrees around config.posRest, period
+// of one full cycle in ms, and the number of cycles before it winds down (0 for
+// no limit). A running swing keeps its phase, so retuning never jerks the servo.
+void startSwing(byte amplitude, unsigned long period, byte cycles) {
+    period = constrain(period, MOTION_MIN_PERIOD, MOTION_MAX_PERIOD);
+    uint16_t step = (65536UL * SERVO_UPDATE_MS) / period; // 1..16384
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!motionActive) {
+            motionPhase = 0;
+            motionAmplitude = 0; // Ramp up from rest
+            motionTicks = 0;
+        }
+        motionPhaseStep = step;
+        motionTargetAmplitude = (unsigned int)amplitude << 8;
+        motionCyclesLeft = cycles;
+        motionActive = true;
+    }
+}
+
+// Full swing out to config.posMax at the configured speed
+void startDefaultSwing() {
+    byte amplitude = config.posMax - config.posRest;
+    startSwing(amplitude, 4UL * amplitude * config.swingSpeed, config.swingCycles);
+}
+
+// Ramps the amplitude down and stops at rest, wherever the swing is
+void stopSwing() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        motionTargetAmplitude = 0;
+    }
+}
+
+bool isCradleSwinging() {
+    return motionActive;
+}
+
+// sin(phase) scaled to -255..255
+int motionSine(uint16_t phase) {
+    byte index = (phase >> 8) & 63;
+    byte quadrant = phase >> 14;
+    if (quadrant & 1) index = 64 - index;
+    int value = pgm_read_byte(&SINE_TABLE[index]);
+    return quadrant & 2 ? -value : value;
+}
+
+// Called every 1 ms from the Timer2 tick; moves the servo every SERVO_UPDATE_MS.
+void motionTickISR() {
+    if (!motionActive || ++motionTicks < SERVO_UPDATE_MS) return;
+    motionTicks = 0;
+
+    // Ramp the amplitude towards its target
+    if (motionAmplitude < motionTargetAmplitude) {
+        motionAmplitude = min(motionAmplitude + MOTION_RAMP_STEP, motionTargetAmplitude);
+    } else if (motionAmplitude > motionTargetAmplitude) {
+        motionAmplitude = motionAmplitude > motionTargetAmplitude + MOTION_RAMP_STEP
+                        ? motionAmplitude - MOTION_RAMP_STEP : motionTargetAmplitude;
+    }
+
+    uint16_t previousPhase = motionPhase;
+    motionPhase += motionPhaseStep;
+    if (motionPhase < previousPhase && motionCyclesLeft > 0 && --motionCyclesLeft == 0) {
+        motionTargetAmplitude = 0; // Last cycle done: wind down
+    }
+
+    if (motionAmplitude == 0 && motionTargetAmplitude == 0) {
+        halServoWrite(config.posRest);
+        motionActive = false;
+        motionStopped = true;
+        return;
+    }
+
+    int offset = ((long)motionAmplitude * motionSine(motionPhase)) >> 16;
+    halServoWrite(constrain(config.posRest + offset, config.posMin, config.posMax));
+}
+
+// --- BUZZER PATTERN ENGINE ---
+// Plays a pattern count times. It preempts a lower-priority pattern, which then
+// waits to resume; otherwise it waits (replacing any lower-priority waiting one).
+void startBuzzer(BuzzerMode mode, int count) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (buzzerMode == mode) return; // Already playing
+        if (buzzerMode == OFF) {
+            playBuzzerPattern(mode, count);
+        } else if (buzzerPriority(mode) > buzzerPriority(buzzerMode)) {
+            setPendingBuzzer(buzzerMode, buzzerRepeatsLeft);
+            playBuzzerPattern(mode, count);
+        } else {
+            setPendingBuzzer(mode, count);
+        }
+    }
+}
+
+void stopBuzzer() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        buzzerMode = OFF;
+        buzzerPendingMode = OFF;
+        halSetBuzzer(false);
+    }
+}
+
+// Silences the buzzer for BUZZER_MUTE_TIME; alerts still go out by SMS
+void muteBuzzer() {
+    stopBuzzer();
+    buzzerMuted = true;
+    buzzerMuteTime = halMillis();
+}
+
+bool isBuzzerMuted() {
+    if (buzzerMuted && halMillis() - buzzerMuteTime >= BUZZER_MUTE_TIME) buzzerMuted = false;
+    return buzzerMuted;
+}
+
+bool isBuzzerActive() {
+    return buzzerMode != OFF;
+}
+
+byte buzzerPriority(BuzzerMode mode) {
+    return pgm_read_byte(&BUZZER_PRIORITIES[mode]);
+}
+
+void setPendingBuzzer(BuzzerMode mode, byte repeats) {
+    if (buzzerPendingMode == OFF || buzzerPriority(mode) >= buzzerPriority(buzzerPendingMode)) {
+        buzzerPendingMode = mode;
+        buzzerPendingRepeats = repeats;
+    }
+}
+
+// Interrupts must be off (ISR or atomic block)
+void playBuzzerPattern(BuzzerMode mode, byte repeats) {
+    buzzerMode = mode;
+    buzzerRepeatsLeft = repeats;
+    buzzerStep = (const BuzzerStep*)pgm_read_ptr(&BUZZER_PATTERNS[mode]);
+    loadBuzzerStep();
+}
+
+void loadBuzzerStep() {
+    buzzerStepKind = pgm_read_byte(&buzzerStep->kind);
+    buzzerStepTicks = pgm_read_byte(&buzzerStep->duration) * 10U;
+    halSetBuzzer(buzzerStepKind == BUZZ_ON);
+}
+
+// Called every 1 ms from the Timer2 tick
+void buzzerTickISR() {
+    if (buzzerMode == OFF) return;
+    if (buzzerStepKind == BUZZ_TONE) {
+        halToggleBuzzer(); // For passive buzzers
+    }
+    if (--buzzerStepTicks > 0) return;
+
+    buzzerStep++;
+    if (pgm_read_byte(&buzzerStep->kind) != BUZZ_END) {
+        loadBuzzerStep();
+    } else if (--buzzerRepeatsLeft > 0) {
+        playBuzzerPattern(buzzerMode, buzzerRepeatsLeft);
+    } else if (buzzerPendingMode != OFF) {
+        BuzzerMode next = buzzerPendingMode;
+        buzzerPendingMode = OFF;
+        playBuzzerPattern(next, buzzerPendingRepeats);
+    } else {
+        // Pattern finished
+        halSetBuzzer(false);
+        buzzerMode = OFF;
+    }
+}
+
+// --- SOIL ADC ---
+// Called with every conversion (~1 kHz): decimates and low-pass filters them
+void addSoilReading(unsigned int reading) {
+    soilSampleSum += reading;
+    if (++soilSampleCount < SOIL_OVERSAMPLE) return;
+
+    unsigned int sample = soilSampleSum / SOIL_OVERSAMPLE;
+    soilSampleSum = 0;
+    soilSampleCount = 0;
+
+    if (!soilFilterReady) {
+        soilFilterState = sample << SOIL_FILTER_SHIFT; // Seed with the first sample
+        soilFilterReady = true;
+    } else {
+        soilFilterState += sample - (soilFilterState >> SOIL_FILTER_SHIFT);
+    }
+}
+
+// --- DHT11 READER ---
+void HAL_ISR_ATTR dhtEdgeISR() {
+    unsigned long now = halMicros();
+    unsigned int interval = now - dhtLastEdgeTime;
+    dhtLastEdgeTime = now;
+
+    byte edge = dhtEdgeCount;
+    if (edge >= DHT_EDGE_COUNT) return;
+    if (edge >= 2) {
+        byte bitIndex = edge - 2;
+        dhtData[bitIndex / 8] <<= 1;
+        if (interval > DHT_BIT_THRESHOLD) dhtData[bitIndex / 8] |= 1;
+    }
+    dhtEdgeCount = edge + 1;
+}
+
+// Advances the read cycle. Returns true when a transfer has finished; temperature
+// and humidity are then the decoded values, or NAN if the transfer was
+// incomplete or corrupt.
+bool readDHT(unsigned long currentTime, float& temperature, float& humidity) {
+    switch (dhtState) {
+        case DHT_IDLE:
+            if (currentTime - dhtStateStartTime < DHT_READ_INTERVAL) return false;
+            halDhtStart(); // Start signal
+            dhtState = DHT_START;
+            dhtStateStartTime = currentTime;
+            return false;
+
+        case DHT_START:
+            if (currentTime - dhtStateStartTime < DHT_START_PULSE) return false;
+            memset((void*)dhtData, 0, sizeof(dhtData));
+            dhtEdgeCount = 0;
+            halDhtListen(); // Release the line; the sensor answers
+            dhtState = DHT_RECEIVING;
+            return false;
+
+        case DHT_RECEIVING:
+            if (dhtEdgeCount < DHT_EDGE_COUNT && currentTime - dhtStateStartTime < DHT_START_PULSE + DHT_RESPONSE_TIMEOUT) {
+                return false;
+            }
+            halDhtStop();
+            dhtState = DHT_IDLE; // dhtStateStartTime still marks this cycle's start
+
+            temperature = NAN;
+            humidity = NAN;
+            if (dhtEdgeCount < DHT_EDGE_COUNT) {
+                logMessage(MSG_DHT_TIMEOUT);
+            } else if (((dhtData[0] + dhtData[1] + dhtData[2] + dhtData[3]) & 0xFF) != dhtData[4]) {
+                logMessage(MSG_DHT_CHECKSUM);
+            } else {
+                temperature = dhtData[2];
+                if (dhtData[3] & 0x80) temperature = -1 - temperature; // Below 0 degC
+                temperature += (dhtData[3] & 0x0F) * 0.1;
+                humidity = dhtData[0] + dhtData[1] * 0.1;
+            }
+            return true;
+    }
+    return false;
+}
+
+// NOAA heat index: Steadman's simple formula, or the Rothfusz regression with
+// its low / high humidity adjustments once the simple one passes 80 degF.
+// Computed in Fahrenheit like the published coefficients.
+float heatIndex(float temperature, float humidity) {
+    if (isnan(humidity)) return temperature;
+    float t = temperature * 1.8 + 32;
+    float rh = humidity;
+    float index = 0.5 * (t + 61.0 + (t - 68.0) * 1.2 + rh * 0.094);
+    if (index > 79) {
+        index = -42.379 + 2.04901523 * t + 10.14333127 * rh
+                - 0.22475541 * t * rh - 0.00683783 * t * t
+                - 0.05481717 * rh * rh + 0.00122874 * t * t * rh
+                + 0.00085282 * t * rh * rh - 0.00000199 * t * t * rh * rh;
+        if (rh < 13 && t >= 80 && t <= 112) {
+            index -= (13 - rh) * 0.25 * sqrt((17 - fabs(t - 95)) / 17);
+        } else if (rh > 85 && t >= 80 && t <= 87) {
+            index += (rh - 85) * 0.1 * (87 - t) * 0.2;
+        }
+    }
+    return (index - 32) / 1.8;
+}
+
+// --- SCHEDULER ---
+// Cooperative: each pass of loop() runs at most one due task, the one with the
+// highest priority, and the CPU idles until the next deadline when none is due.
+// The table is defined here, after the task functions it points to.
+Task tasks[TASK_COUNT] = {
+    // run                 period              next prio budget(us)
+    { taskCradle,          100,                0,   7,   100,   0 },
+    { taskGSM,             10,                 0,   6,   3000,  0 }, // GSM_TX_CHUNK bytes at ~1 ms each
+    { taskEvents,          10,                 0,   5,   2000,  0 }, // Subscribers log over Serial
+    { taskSampleSound,     20,                 0,   4,   100,   0 },
+    { taskFlushLCD,        10,                 0,   3,   2500,  0 }, // LCD_CHARS_PER_PASS over I2C
+    { taskSampleSoil,      250,                0,   2,   300,   0 },
+    { taskUpdateDisplay,   500,                0,   1,   500,   0 },
+    { taskReadTemperature, 5,                  0,   0,   200,   0 }, // Steps the DHT state machine
+    { taskConsole,         50,                 0,   0,   500,   0 },
+    { taskPower,           250,                0,   0,   300,   0 }, // Backlight is one I2C write
+    { taskStorage,         5,                  0,   1,   300,   0 }, // One EEPROM byte per run
+    { taskTrend,           60000,              0,   0,   500,   0 }, // Rescans the ring at worst
+    { taskSelfTest,        100,                0,   0,   2000,  0 }, // Reports over Serial when done
+#if ENABLE_TELEMETRY
+    { taskTelemetry,       TELEMETRY_SAMPLE_INTERVAL, 0, 0, 400,  0 }, // Float math for one sample
+#endif
+};
+
+bool isTaskDue(const Task& task, unsigned long currentTime) {
+    return (long)(currentTime - task.nextRun) >= 0;
+}
+
+// A due task is held back if its budget would run past the next deadline of a
+// higher-priority task, but only when that task's period leaves a gap wide enough
+// to run it later. A long-running task is then slotted into the next gap instead
+// of delaying a more urgent one.
+// Only tasks in taskMask count: the others run on another core.
+bool taskFitsBeforeDeadlines(int id, unsigned long currentTime, unsigned int taskMask) {
+    for (int other = 0; other < TASK_COUNT; other++) {
+        if (!(taskMask & TASK_BIT(other))) continue;
+        if (tasks[other].priority <= tasks[id].priority) continue;
+        if (tasks[other].period * 1000UL <= tasks[id].budget) continue; // No gap will ever fit
+
+        long untilDeadline = (long)(tasks[other].nextRun - currentTime);
+        if (untilDeadline * 1000L < (long)tasks[id].budget) return false;
+    }
+    return true;
+}
+
+int pickTask(unsigned long currentTime, unsigned int taskMask) {
+    int best = -1;
+    for (int id = 0; id < TASK_COUNT; id++) {
+        if (!(taskMask & TASK_BIT(id))) continue;
+        if (!isTaskDue(tasks[id], currentTime)) continue;
+        if (best >= 0 && tasks[id].priority <= tasks[best].priority) continue;
+        if (!taskFitsBeforeDeadlines(id, currentTime, taskMask)) continue;
+        best = id;
+    }
+    return best;
+}
+
+// Runs the most urgent due task of those in taskMask. Each core has its own
+// scheduler loop over its own tasks; the task table is shared.
+void runScheduler(unsigned int taskMask) {
+#if ENABLE_PROFILING
+    unsigned long passStartTime = halMicros();
+#endif
+    unsigned long currentTime = halMillis();
+    int id = pickTask(currentTime, taskMask);
+
+    if (id < 0) {
+        // Nothing due: idle until the next interrupt. The millis() timer ticks
+        // every ~1 ms, so this never oversleeps a deadline. Any other interrupt
+        // (sound tick, GSM RX pin change, Serial RX) wakes the CPU too.
+        bool accountPower = (taskMask & TASK_BIT(TASK_POWER)) != 0; // Once, on the core that owns it
+        if (accountPower) accountPowerMode(POWER_RUN);
+        halIdle();
+        if (accountPower) accountPowerMode(isQuiet ? POWER_QUIET : POWER_IDLE);
+        superviseTasks(currentTime);
+        return;
+    }
+
+    Task& task = tasks[id];
+    task.nextRun += task.period;
+    if (isTaskDue(task, currentTime)) {
+        task.nextRun = currentTime + task.period; // Fell behind: skip missed runs rather than burst
+    }
+
+#if HAL_CORES > 1
+    halLockTasks(); // Tasks share globals freely, so only one runs at a time
+#endif
+    unsigned long startTime = halMicros();
+    currentTask = id;
+    task.run(currentTime);
+    currentTask = TASK_COUNT;
+    unsigned long endTime = halMicros();
+    if (endTime - startTime > task.budget) task.overruns++;
+
+#if ENABLE_PROFILING
+    recordProfile(id, endTime - startTime);
+    recordProfile(PROFILE_PASS, endTime - passStartTime);
+    if (endTime - passStartTime > LOOP_BUDGET_US) loopOverruns++;
+#endif
+#if HAL_CORES > 1
+    halUnlockTasks();
+#endif
+    superviseTasks(currentTime);
+}
+
+// --- WATCHDOG ---
+void startWatchdog() {
+    unsigned long now = halMillis();
+    for (byte id = 0; id < TASK_COUNT; id++) {
+        tasks[id].nextRun = now; // However long setup() took, every task starts on time
+    }
+    halWatchdogStart();
+}
+
+// Feeds the watchdog only while no task is more than TASK_STALL_TIME past its
+// deadline. A task that is never picked again is as dead as a hung one.
+void superviseTasks(unsigned long currentTime) {
+    for (byte id = 0; id < TASK_COUNT; id++) {
+        if ((long)(currentTime - tasks[id].nextRun) > TASK_STALL_TIME) {
+            resetAfterFault(RESET_TASK_STALLED, id);
+        }
+    }
+    halWatchdogFeed();
+}
+
+// Runs from the watchdog interrupt: whatever was running never returned
+void watchdogExpired() {
+    resetAfterFault(RESET_TASK_HUNG, currentTask);
+}
+
+// Leaves a note for the next boot, then resets
+void resetAfterFault(ResetCause cause, byte task) {
+    resetReport.magic = RESET_REPORT_MAGIC;
+    resetReport.cause = cause;
+    resetReport.task = task;
+    halReset();
+}
+
+// A reset we caused ourselves carries its note. SRAM only keeps it through a
+// reset that left the supply up, so the note is trusted after anything but a
+// power-on or brown-out; that includes flags a bootloader swallowed. It is
+// cleared once read, so a later reset pin press is not taken for the same fault.
+void readResetCause() {
+    lastResetCause = halResetCause();
+    lastResetTask = TASK_COUNT;
+    if (lastResetCause != RESET_POWER_ON && lastResetCause != RESET_BROWNOUT
+            && resetReport.magic == RESET_REPORT_MAGIC
+            && resetReport.cause < RESET_CAUSE_COUNT && resetReport.task <= TASK_COUNT) {
+        lastResetCause = (ResetCause)resetReport.cause;
+        lastResetTask = resetReport.task;
+    }
+    resetReport.magic = 0;
+}
+
+void reportResetCause() {
+    console.print(messageF(MSG_LAST_RESET));
+    console.print((const __FlashStringHelper*)RESET_CAUSE_NAMES[lastResetCause]);
+    if (lastResetTask < TASK_COUNT) {
+        console.print(F(", task "));
+        console.print((const __FlashStringHelper*)TASK_NAMES[lastResetTask]);
+    }
+    console.println();
+}
+
+// --- POWER MANAGEMENT ---
+void startPowerSaving() {
+    halPowerDownUnused();
+    powerMarkTime = halMicros();
+}
+
+// Anything still in progress keeps the unit out of the quiet state
+bool isSystemBusy() {
+    return isCradleSwinging() || isBuzzerActive() || isCrying || isDiaperAlertActive || isOverheated
+        || eventTail != eventHead || alertQueueCount > 0 || escalation.type != ALERT_TYPE_COUNT
+        || gsmState >= GSM_WAIT_PROMPT || smsInboxCount > 0;
+}
+
+void managePower(unsigned long currentTime) {
+    if (isSystemBusy()) {
+        lastBusyTime = currentTime;
+        if (isQuiet) {
+            isQuiet = false;
+            halLcdBacklight(true);
+        }
+    } else if (!isQuiet && currentTime - lastBusyTime >= QUIET_DELAY) {
+        isQuiet = true;
+        halLcdBacklight(false);
+    }
+}
+
+// Charges the time since the last mode change to the mode that just ended
+void accountPowerMode(PowerMode mode) {
+    unsigned long now = halMicros();
+    powerModeMicros[mode] += now - powerMarkTime;
+    powerMarkTime = now;
+    if (powerModeMicros[mode] >= 1000000UL) {
+        powerModeMicros[mode] -= 1000000UL;
+        powerModeSeconds[mode]++;
+    }
+}
+
+void printPowerReport() {
+    unsigned long totalSeconds = 0;
+    unsigned long charge = 0; // mA * s
+    for (byte mode = 0; mode < POWER_MODE_COUNT; mode++) {
+        totalSeconds += powerModeSeconds[mode];
+        charge += powerModeSeconds[mode] * pgm_read_word(&POWER_MODE_CURRENT[mode]);
+    }
+    console.println(F("mode   time(s)  share  mA"));
+    for (byte mode = 0; mode < POWER_MODE_COUNT; mode++) {
+        char name[6];
+        strcpy_P(name, POWER_MODE_NAMES[mode]);
+        char line[32];
+        snprintf_P(line, sizeof(line), PSTR("%-6s %8lu %4lu%% %3u"), name, powerModeSeconds[mode],
+                   totalSeconds ? powerModeSeconds[mode] * 100 / totalSeconds : 0UL,
+                   pgm_read_word(&POWER_MODE_CURRENT[mode]));
+        console.println(line);
+    }
+    console.print(F("Average mA: "));
+    console.println(totalSeconds ? charge / totalSeconds : 0UL);
+    console.print(F("Backlight: "));
+    console.println(isQuiet ? F("off") : F("on"));
+}
+
+// --- EEPROM WRITER ---
+// An EEPROM byte takes ~3.4 ms to program. Writing it from a task, one byte at
+// a time and only when the previous write has finished, keeps that off the
+// alert path. Bytes that already hold the right value are skipped.
+bool startEepromWrite(int address, const void* data, byte length) {
+    if (eepromRemaining > 0) return false;
+    eepromSource = (const byte*)data;
+    eepromAddress = address;
+    eepromRemaining = length;
+    return true;
+}
+
+bool isEepromBusy() {
+    return eepromRemaining > 0 || !halEepromReady();
+}
+
+void readEeprom(int address, void* data, byte length) {
+    byte* bytes = (byte*)data;
+    for (byte i = 0; i < length; i++) bytes[i] = halEepromRead(address + i);
+}
+
+void manageEeprom() {
+    while (eepromRemaining > 0 && halEepromReady()) {
+        byte value = *eepromSource++;
+        int address = eepromAddress++;
+        eepromRemaining--;
+        if (halEepromRead(address) != value) {
+            halEepromWrite(address, value); // Returns once programming has started
+            eepromChanged = true;
+            return;
+        }
+    }
+    if (eepromRemaining == 0 && eepromChanged) {
+        eepromChanged = false;
+        halEepromCommit();
+    }
+}
+
+// --- CONFIG ---
+#if BOARD == BOARD_ESP32 && !HAL_HOST
+// <util/crc16.h> is AVR-only: the same CRC-16 (polynomial 0xA001), so a
+// config block moves between boards unchanged
+uint16_t _crc16_update(uint16_t crc, uint8_t data) {
+    crc ^= data;
+    for (byte i = 0; i < 8; i++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    return crc;
+}
+#endif
+
+uint16_t configCrc(const Config& block) {
+    const byte* bytes = (const byte*)&block;
+    uint16_t crc = 0xFFFF;
+    for (byte i = 0; i < offsetof(Config, crc); i++) {
+        crc = _crc16_update(crc, bytes[i]);
+    }
+    return crc;
+}
+
+void setDefaultConfig() {
+    config.version = CONFIG_VERSION;
+    config.temperatureThreshold = TEMPERATURE_THRESHOLD;
+    config.fanHysteresis = FAN_HYSTERESIS;
+    config.criticalTemperature = CRITICAL_TEMPERATURE;
+    config.wetnessThreshold = WETNESS_THRESHOLD;
+    config.drynessThreshold = DRYNESS_THRESHOLD;
+    config.soundFloor = 0;
+    config.calibrated = 0;          // The next self-test calibrates the unit
+    config.swingSpeed = CRADLE_SWING_SPEED;
+    config.posRest = CRADLE_POS_REST;
+    config.posMin = CRADLE_POS_MIN;
+    config.posMax = CRADLE_POS_MAX;
+    config.swingCycles = CRADLE_SWING_CYCLES;
+    config.quietTime = SOOTHE_QUIET_TIME;
+    memset(config.phoneNumbers, 0, sizeof(config.phoneNumbers)); // No escalation numbers
+    strncpy_P(config.phoneNumbers[0], PARENT_PHONE_NUMBER, PHONE_NUMBER_LENGTH - 1);
+}
+
+// The only place the config is read from EEPROM; runs before anything uses it
+void loadConfig() {
+    readEeprom(CONFIG_ADDRESS, &config, sizeof(config));
+    if (config.version != CONFIG_VERSION || config.crc != configCrc(config)) {
+        logMessage(MSG_CONFIG_DEFAULTS);
+        setDefaultConfig();
+        saveConfig();
+    }
+}
+
+void saveConfig() {
+    config.crc = configCrc(config);
+    configDirty = true;
+}
+
+// Hands a snapshot of the config to the EEPROM writer once it is free
+void manageConfig() {
+    if (!configDirty || isEepromBusy()) return;
+    configDirty = false;
+    configWriteBuffer = config;
+    startEepromWrite(CONFIG_ADDRESS, &configWriteBuffer, sizeof(configWriteBuffer));
+}
+
+bool isPhoneNumber(const char* text) {
+    size_t length = strlen(text);
+    if (length < 3 || length >= PHONE_NUMBER_LENGTH) return false;
+    for (size_t i = 0; i < length; i++) {
+        if (!isdigit(text[i]) && !(i == 0 && text[i] == '+')) return false;
+    }
+    return true;
+}
+
+// Applies one "<KEY> <value>" setting, e.g. "TEMP 31.5", as sent over Serial
+// or SMS. Settings that would leave the config inconsistent are refused.
+bool applyConfigSetting(const char* setting) {
+    const char* value = strchr(setting, ' ');
+    bool ok = value != NULL;
+    if (ok) {
+        size_t keyLength = value - setting;
+        value++;
+        long number = atol(value);
+        Config updated = config;
+
+        if (keyLength == 4 && strncasecmp_P(setting, PSTR("TEMP"), 4) == 0) {
+            updated.temperatureThreshold = atof(value);
+            ok = updated.temperatureThreshold >= 10 && updated.temperatureThreshold <= 45;
+        } else if (keyLength == 4 && strncasecmp_P(setting, PSTR("HYST"), 4) == 0) {
+            updated.fanHysteresis = atof(value);
+            ok = updated.fanHysteresis >= 0 && updated.fanHysteresis <= 5;
+        } else if (keyLength == 4 && strncasecmp_P(setting, PSTR("CRIT"), 4) == 0) {
+            updated.criticalTemperature = atof(value);
+            ok = updated.criticalTemperature >= 25 && updated.criticalTemperature <= 50;
+        } else if (keyLength == 3 && strncasecmp_P(setting, PSTR("WET"), 3) == 0) {
+            ok = number >= 0 && number <= 1023; // Checked before it is narrowed to an int
+            updated.wetnessThreshold = number;
+            updated.calibrated |= CALIBRATED_SOIL; // Set by hand: not replaced by a calibration
+        } else if (keyLength == 3 && strncasecmp_P(setting, PSTR("DRY"), 3) == 0) {
+            ok = number >= 0 && number <= 1023;
+            updated.drynessThreshold = number;
+            updated.calibrated |= CALIBRATED_SOIL;
+        } else if (keyLength == 5 && strncasecmp_P(setting, PSTR("NOISE"), 5) == 0) {
+            ok = number >= 0 && number <= SOUND_MAX_FLOOR;
+            updated.soundFloor = number;
+            updated.calibrated |= CALIBRATED_SOUND;
+        } else if (keyLength == 5 && strncasecmp_P(setting, PSTR("SPEED"), 5) == 0) {
+            ok = number >= 5 && number <= 200;
+            updated.swingSpeed = number;
+        } else if (keyLength == 4 && strncasecmp_P(setting, PSTR("REST"), 4) == 0) {
+            updated.posRest = constrain(number, 0, 180);
+        } else if (keyLength == 3 && strncasecmp_P(setting, PSTR("MIN"), 3) == 0) {
+            updated.posMin = constrain(number, 0, 180);
+        } else if (keyLength == 3 && strncasecmp_P(setting, PSTR("MAX"), 3) == 0) {
+            updated.posMax = constrain(number, 0, 180);
+        } else if (keyLength == 6 && strncasecmp_P(setting, PSTR("CYCLES"), 6) == 0) {
+            ok = number >= 1 && number <= 20;
+            updated.swingCycles = number;
+        } else if (keyLength == 5 && strncasecmp_P(setting, PSTR("QUIET"), 5) == 0) {
+            ok = number >= 5 && number <= 240;
+            updated.quietTime = number;
+        } else if ((keyLength == 5 || keyLength == 6) && strncasecmp_P(setting, PSTR("PHONE"), 5) == 0) {
+            // PHONE is the primary number, PHONE2.. the escalation order; "-" clears one of those
+            byte slot = keyLength == 5 ? 0 : setting[5] - '1';
+            bool clear = slot > 0 && strcmp_P(value, PSTR("-")) == 0;
+            ok = slot < ALERT_RECIPIENTS && (clear || isPhoneNumber(value));
+            if (ok) strcpy(updated.phoneNumbers[slot], clear ? "" : value);
+        } else {
+            ok = false;
+        }
+
+        ok = ok && updated.wetnessThreshold >= 0 && updated.wetnessThreshold < updated.drynessThreshold
+                && updated.drynessThreshold <= 1023
+                && updated.criticalTemperature > updated.temperatureThreshold // Fan before the alert
+                && updated.posMin < updated.posRest && updated.posRest < updated.posMax;
+        if (ok) {
+            config = updated;
+            saveConfig();
+        }
+    }
+
+    if (ok) {
+        logMessage(MSG_CONFIG_UPDATED);
+    } else {
+        console.print(messageF(MSG_CONFIG_INVALID));
+        console.println(setting);
+    }
+    return ok;
+}
+
+// Printed in the same form SET accepts, so a unit's settings can be copied
+void printConfig() {
+    console.print(F("TEMP "));   console.println(config.temperatureThreshold, 1);
+    console.print(F("HYST "));   console.println(config.fanHysteresis, 1);
+    console.print(F("CRIT "));   console.println(config.criticalTemperature, 1);
+    console.print(F("WET "));    console.println(config.wetnessThreshold);
+    console.print(F("DRY "));    console.println(config.drynessThreshold);
+    console.print(F("NOISE "));  console.println(config.soundFloor);
+    console.print(F("SPEED "));  console.println(config.swingSpeed);
+    console.print(F("REST "));   console.println(config.posRest);
+    console.print(F("MIN "));    console.println(config.posMin);
+    console.print(F("MAX "));    console.println(config.posMax);
+    console.print(F("CYCLES ")); console.println(config.swingCycles);
+    console.print(F("QUIET "));  console.println(config.quietTime);
+    console.print(F("PHONE "));  console.println(config.phoneNumbers[0]);
+    for (byte slot = 1; slot < ALERT_RECIPIENTS; slot++) {
+        console.print(F("PHONE"));
+        console.print(slot + 1);
+        console.print(' ');
+        console.println(config.phoneNumbers[slot][0] != '\0' ? config.phoneNumbers[slot] : "-");
+    }
+}
+
+// --- EVENT LOG ---
+byte logPageChecksum(const LogPage& page) {
+    const byte* bytes = (const byte*)&page;
+    byte sum = 0;
+    for (byte i = 0; i < sizeof(LogPage); i++) {
+        if (i != offsetof(LogPage, checksum)) sum += bytes[i];
+    }
+    return sum;
+}
+
+int logPageAddress(byte page) {
+    return LOG_START + page * sizeof(LogPage);
+}
+
+bool readLogPage(byte page, LogPage& contents) {
+    readEeprom(logPageAddress(page), &contents, sizeof(contents));
+    return contents.count >= 1 && contents.count <= LOG_RECORDS_PER_PAGE
+        && contents.checksum == logPageChecksum(contents);
+}
+
+// Finds the newest page written before the reset and continues after it
+void startEventLog() {
+    LogPage page;
+    bool found = false;
+    for (byte i = 0; i < LOG_PAGES; i++) {
+        if (!readLogPage(i, page)) continue;
+        if (!found || (int16_t)(page.sequence - logSequence) >= 0) {
+            found = true;
+            logSequence = page.sequence;
+            logNextPage = i;
+        }
+    }
+    if (found) {
+        logSequence++;
+        logNextPage = (logNextPage + 1) % LOG_PAGES;
+    }
+    logEvent(LOG_BOOT, lastResetCause * 16 + lastResetTask);
+}
+
+void logEvent(LogType type, byte value) {
+    unsigned long now = halMillis();
+    if (logRingCount == LOG_RAM_RECORDS) {
+        logDropped++; // EEPROM writes are behind: keep the older history
+        return;
+    }
+    if (logRingCount == 0) logOldestTime = now;
+
+    unsigned long seconds = (now - logLastTime) / 1000;
+    logLastTime += seconds * 1000;
+    LogRecord& record = logRing[(logRingHead + logRingCount) % LOG_RAM_RECORDS];
+    record.delta = min(seconds, 65535UL);
+    record.type = type;
+    record.value = value;
+    logRingCount++;
+}
+
+// Moves records from the RAM ring into the next EEPROM page, a full page at a
+// time or whatever is there once the oldest record has waited long enough
+void manageEventLog(unsigned long currentTime) {
+    if (logRingCount == 0 || isEepromBusy()) return;
+    if (logRingCount < LOG_RECORDS_PER_PAGE && currentTime - logOldestTime < LOG_FLUSH_INTERVAL) return;
+
+    byte count = min(logRingCount, LOG_RECORDS_PER_PAGE);
+    memset(&logPage, 0xFF, sizeof(logPage));
+    logPage.sequence = logSequence++;
+    logPage.count = count;
+    for (byte i = 0; i < count; i++) {
+        logPage.records[i] = logRing[logRingHead];
+        logRingHead = (logRingHead + 1) % LOG_RAM_RECORDS;
+    }
+    logRingCount -= count;
+    logOldestTime = currentTime;
+    logPage.checksum = logPageChecksum(logPage);
+
+    startEepromWrite(logPageAddress(logNextPage), &logPage, sizeof(logPage));
+    logNextPage = (logNextPage + 1) % LOG_PAGES;
+}
+
+void startLogDump() {
+    console.println(F("s event value"));
+    logDumpPage = LOG_PAGES; // Oldest page first: the one about to be overwritten next
+    logDumpRecord = 0;
+    logDumpTime = 0;
+}
+
+void printLogRecord(const LogRecord& record) {
+    if (record.type >= LOG_TYPE_COUNT) return;
+    logDumpTime = record.type == LOG_BOOT ? 0 : logDumpTime + record.delta;
+    char name[8];
+    strcpy_P(name, LOG_TYPE_NAMES[record.type]);
+    char line[24];
+    snprintf_P(line, sizeof(line), PSTR("%lu %s %u"), logDumpTime, name, record.value);
+    console.println(line);
+}
+
+// Prints the log a record at a time, as fast as the Serial TX buffer drains:
+// EEPROM pages oldest first, then the records still in RAM
+void manageLogDump() {
+    while (logDumpPage >= 0 && console.availableForWrite() >= 24) {
+        if (logDumpPage > 0) {
+            if (!halEepromReady()) return; // Reading now would wait for the write
+            LogPage page;
+            byte index = (logNextPage + LOG_PAGES - logDumpPage) % LOG_PAGES;
+            if (!readLogPage(index, page) || logDumpRecord >= page.count) {
+                logDumpPage--;
+                logDumpRecord = 0;
+                continue;
+            }
+            printLogRecord(page.records[logDumpRecord++]);
+        } else if (logDumpRecord < logRingCount) {
+            printLogRecord(logRing[(logRingHead + logDumpRecord++) % LOG_RAM_RECORDS]);
+        } else {
+            logDumpPage = -1;
+            console.print(F("Dropped: "));
+            console.println(logDropped);
+        }
+    }
+}
+
+// --- TRENDS ---
+void addTrendSample(float temperature, byte cries, bool wet, unsigned long cryTime) {
+    if (trendCount == TREND_SAMPLES) dropOldestTrendSample();
+
+    TrendSample sample;
+    if (isnan(temperature)) {
+        sample.temperatureDelta = TREND_NO_READING;
+    } else {
+        int tenths = lround(temperature * 10);
+        if (!trendHasTemperature) {
+            trendHasTemperature = true;
+            trendBaseTemperature = trendLastTemperature = tenths;
+        }
+        // A jump too large for one delta is caught up over the next samples
+        int delta = constrain(tenths - trendLastTemperature, TREND_NO_READING + 1, INT8_MAX);
+        sample.temperatureDelta = delta;
+        trendLastTemperature += delta;
+        if (trendTemperatureCount == 0 || trendLastTemperature < trendMinTemperature) {
+            trendMinTemperature = trendLastTemperature;
+        }
+        if (trendTemperatureCount == 0 || trendLastTemperature > trendMaxTemperature) {
+            trendMaxTemperature = trendLastTemperature;
+        }
+        trendTemperatureSum += trendLastTemperature;
+        trendTemperatureCount++;
+    }
+    cries = min(cries, 7);
+    byte cryUnits = min((cryTime + TREND_CRY_UNIT / 2) / TREND_CRY_UNIT, 15UL);
+    sample.activity = cries << 5 | (wet ? 0x10 : 0) | cryUnits;
+    trendCries += cries;
+    trendCryUnits += cryUnits;
+    trendWetSamples += wet;
+
+    trendRing[(trendHead + trendCount) % TREND_SAMPLES] = sample;
+    trendCount++;
+}
+
+void dropOldestTrendSample() {
+    const TrendSample& oldest = trendRing[trendHead];
+    trendHead = (trendHead + 1) % TREND_SAMPLES;
+    trendCount--;
+    trendCries -= oldest.activity >> 5;
+    trendCryUnits -= oldest.activity & 0x0F;
+    trendWetSamples -= (oldest.activity & 0x10) != 0;
+    if (oldest.temperatureDelta == TREND_NO_READING) return;
+
+    trendBaseTemperature += oldest.temperatureDelta;
+    trendTemperatureSum -= trendBaseTemperature;
+    trendTemperatureCount--;
+    // Only losing an extreme needs the ring: at most once per sample, TREND_SAMPLES steps
+    if (trendBaseTemperature == trendMinTemperature || trendBaseTemperature == trendMaxTemperature) {
+        rescanTrendExtremes();
+    }
+}
+
+void rescanTrendExtremes() {
+    int temperature = trendBaseTemperature;
+    bool first = true;
+    for (byte i = 0; i < trendCount; i++) {
+        const TrendSample& sample = trendRing[(trendHead + i) % TREND_SAMPLES];
+        if (sample.temperatureDelta == TREND_NO_READING) continue;
+        temperature += sample.temperatureDelta;
+        if (first || temperature < trendMinTemperature) trendMinTemperature = temperature;
+        if (first || temperature > trendMaxTemperature) trendMaxTemperature = temperature;
+        first = false;
+    }
+}
+
+// Hours covered by the ring, rounded up
+byte trendHours() {
+    return (trendCount * (TREND_INTERVAL / 60000) + 59) / 60;
+}
+
+// e.g. "24h: 21.3-27.9C avg 24.6, 5 cries 42 min, wet 1.3h"
+void formatTrend(char* text, size_t size) {
+    char temperatures[24] = "no temp";
+    if (trendTemperatureCount > 0) {
+        char low[7], high[7], mean[7];
+        dtostrf(trendMinTemperature / 10.0, 1, 1, low);
+        dtostrf(trendMaxTemperature / 10.0, 1, 1, high);
+        dtostrf(trendTemperatureSum / 10.0 / trendTemperatureCount, 1, 1, mean);
+        snprintf_P(temperatures, sizeof(temperatures), PSTR("%s-%sC avg %s"), low, high, mean);
+    }
+    unsigned int wetTenths = (unsigned long)trendWetSamples * TREND_INTERVAL / 360000;
+    snprintf_P(text, size, PSTR("%uh: %s, %u cries %lu min, wet %u.%uh"), trendHours(), temperatures,
+               trendCries, (unsigned long)trendCryUnits * TREND_CRY_UNIT / 60000, wetTenths / 10, wetTenths % 10);
+}
+
+void composeTrendReply() {
+    if (trendCount == 0) {
+        replyMessage(MSG_NO_TREND);
+        return;
+    }
+    formatTrend(smsReplyText, SMS_REPLY_LENGTH);
+}
+
+// --- SELF-TEST ---
+void startSelfTest() {
+    selfTestState = SELFTEST_SENSORS;
+    selfTestStartTime = halMillis();
+    selfTestFaults = 0;
+    selfTestCalibrating = ~config.calibrated & (CALIBRATED_SOIL | CALIBRATED_SOUND);
+    soilBaselineSum = 0;
+    soilBaselineCount = 0;
+    soundPeakLevel = 0;
+    soundAlwaysActive = true;
+}
+
+// Every task pass of the sensor phase: one soil reading and one sound window
+void sampleSelfTest(unsigned long currentTime) {
+    if (currentTime - selfTestStartTime >= CRY_WINDOW_BINS * CRY_BIN_MS) { // The window is full since boot
+        unsigned int edges, activeMs;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            edges = windowEdges;
+            activeMs = windowActiveMs;
+        }
+        soundPeakLevel = max(soundPeakLevel, soundLevel(edges, activeMs));
+        if (activeMs < CRY_WINDOW_BINS * CRY_BIN_MS) soundAlwaysActive = false;
+    }
+
+    if (!soilFilterReady) return;
+    unsigned int filterState;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        filterState = soilFilterState;
+    }
+    unsigned int soil = filterState >> SOIL_FILTER_SHIFT;
+    if (soilBaselineCount++ == 0) soilBaselineMin = soilBaselineMax = soil;
+    soilBaselineSum += soil;
+    soilBaselineMin = min(soilBaselineMin, soil);
+    soilBaselineMax = max(soilBaselineMax, soil);
+}
+
+// Judges the sensors and stores any calibration; the modem is judged later
+void finishSensorTest() {
+    bool configChanged = false;
+    if (isnan(lastTemperature)) selfTestFaults |= FAULT_DHT; // Two read attempts, both failed
+
+    // A floating or broken probe wanders; a working one barely moves in a few seconds
+    if (soilBaselineCount == 0 || soilBaselineMax - soilBaselineMin > SOIL_MAX_SPREAD) {
+        selfTestFaults |= FAULT_SOIL;
+    } else if (selfTestCalibrating & CALIBRATED_SOIL) {
+        unsigned int baseline = soilBaselineSum / soilBaselineCount;
+        if (baseline < SOIL_MIN_DRY_LEVEL) {
+            logMessage(MSG_SOIL_SKIPPED); // Tried again at the next boot
+        } else {
+            config.wetnessThreshold = (unsigned long)baseline * SOIL_WET_PERCENT / 100;
+            config.drynessThreshold = (unsigned long)baseline * SOIL_DRY_PERCENT / 100;
+            config.calibrated |= CALIBRATED_SOIL;
+            configChanged = true;
+            console.print(messageF(MSG_SOIL_CALIBRATED));
+            console.println(baseline);
+        }
+    }
+
+    // Only a stuck output is a fault: a silent room and a dead module look the same
+    if (soundAlwaysActive) {
+        selfTestFaults |= FAULT_SOUND;
+    } else if (selfTestCalibrating & CALIBRATED_SOUND) {
+        if (soundPeakLevel > SOUND_MAX_FLOOR) {
+            logMessage(MSG_SOUND_SKIPPED);
+        } else {
+            config.soundFloor = soundPeakLevel;
+            config.calibrated |= CALIBRATED_SOUND;
+            configChanged = true;
+            console.print(messageF(MSG_SOUND_CALIBRATED));
+            console.println(soundPeakLevel);
+        }
+    }
+
+    if (configChanged) saveConfig();
+    selfTestCalibrating = 0;
+    selfTestState = SELFTEST_MODEM;
+}
+
+void finishSelfTest() {
+    selfTestState = SELFTEST_DONE;
+    logEvent(LOG_SELFTEST, selfTestFaults);
+    if (selfTestFaults == 0) {
+        logMessage(MSG_SELFTEST_PASSED);
+        return;
+    }
+    console.print(messageF(MSG_SELFTEST_FAILED));
+    for (byte fault = 0; fault < FAULT_COUNT; fault++) {
+        if (!(selfTestFaults & (1 << fault))) continue;
+        console.print((const __FlashStringHelper*)FAULT_NAMES[fault]);
+        console.print(' ');
+    }
+    console.println();
+}
+
+// --- MESSAGE FUNCTIONS ---
+const char* messageText(MessageId id) {
+    return (const char*)pgm_read_ptr(&MESSAGE_TABLE[id]);
+}
+
+const __FlashStringHelper* messageF(MessageId id) {
+    return (const __FlashStringHelper*)messageText(id);
+}
+
+void logMessage(MessageId id) {
+    console.println(messageF(id));
+}
+
+// --- SERIAL CONSOLE ---
+void manageSerialConsole() {
+    while (console.available()) {
+        char c = console.read();
+        if (c == '\r' || c == '\n') {
+            if (consoleLineLength == 0) continue;
+            consoleLine[consoleLineLength] = '\0';
+            consoleLineLength = 0;
+            handleConsoleCommand(consoleLine);
+        } else if (consoleLineLength < CONSOLE_LINE_LENGTH - 1) {
+            consoleLine[consoleLineLength++] = c;
+        }
+    }
+}
+
+void handleConsoleCommand(const char* command) {
+#if ENABLE_PROFILING
+    if (strcasecmp_P(command, PSTR("PROF")) == 0) {
+        printProfileReport();
+        return;
+    }
+    if (strcasecmp_P(command, PSTR("PROF RESET")) == 0) {
+        resetProfile();
+        console.println(F("Profile reset."));
+        return;
+    }
+#endif
+    if (strcasecmp_P(command, PSTR("CONFIG")) == 0) {
+        printConfig();
+        return;
+    }
+    if (strcasecmp_P(command, PSTR("CONFIG RESET")) == 0) {
+        setDefaultConfig();
+        saveConfig();
+        logMessage(MSG_CONFIG_UPDATED);
+        return;
+    }
+    if (strncasecmp_P(command, PSTR("SET "), 4) == 0) {
+        applyConfigSetting(command + 4);
+        return;
+    }
+    if (strcasecmp_P(command, PSTR("CALIBRATE")) == 0) {
+        config.calibrated = 0;  // Saved, so an unfinished calibration is retried at boot
+        saveConfig();
+        logMessage(MSG_CALIBRATING);
+        startSelfTest();
+        return;
+    }
+    if (strcasecmp_P(command, PSTR("LOG")) == 0) {
+        startLogDump();
+        return;
+    }
+    if (strcasecmp_P(command, PSTR("POWER")) == 0) {
+        printPowerReport();
+        return;
+    }
+    if (strcasecmp_P(command, PSTR("TREND")) == 0) {
+        char text[SMS_REPLY_LENGTH];
+        formatTrend(text, sizeof(text));
+        console.println(text);
+        return;
+    }
+#if ENABLE_TELEMETRY
+    if (strcasecmp_P(command, PSTR("NET")) == 0) {
+        printTelemetryReport();
+        return;
+    }
+#endif
+    console.print(messageF(MSG_UNKNOWN_COMMAND));
+    console.println(command);
+}
+
+// --- PROFILING ---
+#if ENABLE_PROFILING
+void resetProfile() {
+    memset(profileStats, 0, sizeof(profileStats));
+    for (int i = 0; i <= TASK_COUNT; i++) profileStats[i].minTime = 0xFFFF;
+    loopOverruns = 0;
+    for (int id = 0; id < TASK_COUNT; id++) tasks[id].overruns = 0;
+}
+
+void recordProfile(int entry, unsigned long elapsed) {
+    ProfileStats& stats = profileStats[entry];
+    unsigned int time = elapsed > 0xFFFF ? 0xFFFF : elapsed;
+    stats.count++;
+    stats.totalTime += elapsed;
+    if (time < stats.minTime) stats.minTime = time;
+    if (time > stats.maxTime) stats.maxTime = time;
+
+    int bucket = 0;
+    for (unsigned int t = time >> 3; t != 0 && bucket < PROFILE_BUCKETS - 1; t >>= 1) bucket++;
+    if (stats.histogram[bucket] < 0xFFFF) stats.histogram[bucket]++;
+}
+
+// Upper bound of the histogram bucket holding the 99th percentile
+unsigned long profilePercentile99(const ProfileStats& stats) {
+    unsigned long total = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) total += stats.histogram[b];
+    unsigned long target = total - total / 100;
+    unsigned long seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += stats.histogram[b];
+        if (seen >= target) return 8UL << b;
+    }
+    return 8UL << (PROFILE_BUCKETS - 1);
+}
+
+void printProfileReport() {
+    console.print(F("PROF up="));
+    console.print(halMillis() / 1000);
+    console.print(F("s overruns="));
+    console.print(loopOverruns);
+    console.print(F(" sram="));
+    console.print(halFreeSRAM());
+    console.print(F(" low="));
+    console.println(halFreeSRAMLowWater());
+    console.println(F("task     runs  min  avg  max  p99 over (us)"));
+
+    for (int i = 0; i <= TASK_COUNT; i++) {
+        const ProfileStats& stats = profileStats[i];
+        char line[48];
+        snprintf_P(line, sizeof(line), PSTR(" %5lu %4u %4lu %4u %4lu %4u"), stats.count,
+                 stats.count ? stats.minTime : 0,
+                 stats.count ? stats.totalTime / stats.count : 0,
+                 stats.maxTime, profilePercentile99(stats),
+                 i < TASK_COUNT ? tasks[i].overruns : 0);
+        const char* name = i < TASK_COUNT ? TASK_NAMES[i] : PSTR("pass");
+        console.print((const __FlashStringHelper*)name);
+        for (int pad = strlen_P(name); pad < 8; pad++) console.print(' ');
+        console.println(line);
+    }
+}
+#endif
+
+// --- DISPLAY FUNCTIONS ---
+// Drawing only changes lcdFrame; manageLCD() sends the differences to the display.
+void lcdWrite(int row, int col, const char* text) {
+    while (*text != '\0' && col < LCD_COLS) {
+        lcdFrame[row][col++] = *text++;
+    }
+}
+
+// Same as lcdWrite() for a PROGMEM string
+void lcdWriteP(int row, int col, const char* text) {
+    char c;
+    while ((c = pgm_read_byte(text++)) != '\0' && col < LCD_COLS) {
+        lcdFrame[row][col++] = c;
+    }
+}
+
+void lcdClearLine(int row) {
+    memset(lcdFrame[row], ' ', LCD_COLS);
+}
+
+// Replaces a whole line, padding it with spaces
+void lcdSetLine(int row, const char* text) {
+    lcdClearLine(row);
+    lcdWrite(row, 0, text);
+}
+
+void lcdShowMessage(int row, MessageId id) {
+    lcdClearLine(row);
+    lcdWriteP(row, 0, messageText(id));
+}
+
+void updateLCD(unsigned long currentTime) {
+    // Line 0: Temperature and humidity, alternating with the heat index; fan status
+    char value[8];
+    char line[LCD_COLS + 1];
+    bool secondPage = (currentTime / LCD_PAGE_TIME) & 1;
+    if (isnan(lastTemperature) || currentTime - lastTemperatureTime > DHT_STALE_TIME) {
+        strcpy_P(value, messageText(MSG_LCD_NO_READING)); // Sensor stopped answering
+        snprintf_P(line, sizeof(line), PSTR("Temp: %sC"), value);
+    } else if (secondPage) {
+        dtostrf(lastHeatIndex, 4, 1, value);
+        snprintf_P(line, sizeof(line), PSTR("Feel: %sC"), value);
+    } else {
+        dtostrf(lastTemperature, 4, 1, value); // Temperature with 1 decimal place
+        snprintf_P(line, sizeof(line), PSTR("%sC %2d%%"), value, (int)lastHumidity);
+    }
+    lcdSetLine(0, line);
+#if FAN_PWM
+    if (isFanOn) {
+        char speed[6];
+        snprintf_P(speed, sizeof(speed), PSTR("F%3u%%"), fanDuty);
+        lcdWrite(0, 11, speed);
+    } else {
+        lcdWriteP(0, 11, messageText(MSG_LCD_FAN_OFF));
+    }
+#else
+    lcdWriteP(0, 11, messageText(isFanOn ? MSG_LCD_FAN_ON : MSG_LCD_FAN_OFF));
+#endif
+
+    // Line 1: Status Messages
+    if (isOverheated) {
+        lcdShowMessage(1, MSG_LCD_HOT);
+    } else if (isCradleSwinging()) {
+        lcdShowMessage(1, MSG_LCD_SWINGING);
+    } else if (isDiaperAlertActive) {
+        lcdShowMessage(1, MSG_LCD_WET);
+    } else if (selfTestState == SELFTEST_SENSORS) {
+        lcdShowMessage(1, MSG_LCD_SELFTEST);
+    } else if (selfTestFaults != 0) {
+        lcdShowMessage(1, MSG_LCD_CHECK);
+    } else if (trendTemperatureCount > 0 && secondPage) {
+        // Nothing to report: alternate with the day so far
+        snprintf_P(line, sizeof(line), PSTR("%uh %d-%dC %ucry"), trendHours(),
+                   (int)lround(trendMinTemperature / 10.0), (int)lround(trendMaxTemperature / 10.0), trendCries);
+        lcdSetLine(1, line);
+    } else {
+        lcdShowMessage(1, MSG_LCD_OK);
+    }
+}
+
+// Sends up to LCD_CHARS_PER_PASS changed characters, so a full redraw is spread
+// over several loop passes. Runs of adjacent changes share one cursor move.
+void manageLCD() {
+    if (lcdFault && !recoverLCD()) return;
+    int written = 0;
+    for (int row = 0; row < LCD_ROWS && written < LCD_CHARS_PER_PASS; row++) {
+        for (int col = 0; col < LCD_COLS && written < LCD_CHARS_PER_PASS; col++) {
+            if (lcdFrame[row][col] == lcdShown[row][col]) continue;
+
+            if (row != lcdCursorRow || col != lcdCursorCol) {
+                halLcdSetCursor(col, row);
+                lcdCursorRow = row;
+            }
+            halLcdWrite(lcdFrame[row][col]);
+            lcdShown[row][col] = lcdFrame[row][col];
+            lcdCursorCol = col + 1; // The LCD advances its cursor after each write
+            written++;
+        }
+    }
+    // Checked once per pass, since on the ESP32 it costs a bus probe. After a fault
+    // no more passes run, and recoverLCD() redraws the whole frame anyway.
+    if (written > 0 && halLcdTimedOut()) {
+        lcdFault = true;
+        lcdFaultTime = halMillis();
+        logMessage(MSG_LCD_FAULT);
+    }
+}
+
+// Retries every LCD_RETRY_INTERVAL; true once the display answers again
+bool recoverLCD() {
+    if (halMillis() - lcdFaultTime < LCD_RETRY_INTERVAL) return false;
+    halLcdRecover();
+    if (halLcdTimedOut()) {
+        lcdFaultTime = halMillis();
+        return false;
+    }
+    lcdFault = false;
+    memset(lcdShown, ' ', sizeof(lcdShown)); // begin() cleared it: redraw the whole frame
+    lcdCursorRow = -1;
+    halLcdBacklight(!isQuiet);
+    logMessage(MSG_LCD_RECOVERED);
+    return true;
+}
+
+// --- ALERT QUEUE FUNCTIONS ---
+AlertPriority alertPriority(byte type) {
+    return (AlertPriority)pgm_read_byte(&ALERT_POLICIES[type].priority);
+}
+
+byte alertChannels(byte type) {
+    return pgm_read_byte(&PRIORITY_CHANNELS[alertPriority(type)]);
+}
+
+// Entry point for an alert condition. Its priority decides whether the buzzer
+// sounds, the primary number gets an SMS and a call, and escalation starts.
+void raiseAlert(AlertType type) {
+    byte channels = alertChannels(type);
+    if ((channels & CHANNEL_BUZZER) && !isBuzzerMuted()) {
+        startBuzzer((BuzzerMode)pgm_read_byte(&ALERT_POLICIES[type].buzzerMode), 3);
+    }
+    if (channels & CHANNEL_SMS) queueAlert(type, 0);
+    if ((channels & CHANNEL_CALL) && findQueuedAlert(type, 0, true) < 0) pushAlert(type, 0, true, 1, halMillis());
+
+    // One escalation at a time: a more urgent alert takes it over, a repeat keeps its timer
+    if ((channels & CHANNEL_ESCALATE) && escalation.type != type
+        && (escalation.type == ALERT_TYPE_COUNT || alertPriority(type) >= alertPriority(escalation.type))) {
+        escalation.type = type;
+        escalation.recipient = 0;
+        escalation.time = halMillis();
+    }
+}
+
+// The condition behind an alert has cleared by itself, so nobody else needs waking
+void resolveAlert(AlertType type) {
+    if (escalation.type == type) stopEscalation();
+}
+
+// Drops the escalation and the messages and calls it still had waiting. The
+// primary's own SMS still goes out.
+void stopEscalation() {
+    for (int i = alertQueueCount - 1; i >= 0; i--) {
+        QueuedAlert& alert = alertQueue[i];
+        if (alert.type == escalation.type && (alert.recipient > 0 || alert.call)) removeAlert(i);
+    }
+    escalation.type = ALERT_TYPE_COUNT;
+}
+
+// ACK by SMS from any recipient
+bool acknowledgeAlert(byte recipient) {
+    if (escalation.type == ALERT_TYPE_COUNT) return false;
+    logEvent(LOG_ACK, recipient);
+    stopEscalation();
+    return true;
+}
+
+// No ACK within ESCALATION_INTERVAL: the alert goes to the next configured number
+void escalateAlert(unsigned long currentTime) {
+    byte next = escalation.recipient + 1;
+    while (next < ALERT_RECIPIENTS && config.phoneNumbers[next][0] == '\0') next++;
+    if (next == ALERT_RECIPIENTS) {
+        logMessage(MSG_ESCALATION_DONE);
+        escalation.type = ALERT_TYPE_COUNT;
+        return;
+    }
+    console.print(messageF(MSG_ESCALATING));
+    console.println(config.phoneNumbers[next]);
+    escalation.recipient = next;
+    escalation.time = currentTime;
+    AlertType type = (AlertType)escalation.type;
+    pushAlert(type, next, false, 1, currentTime);
+    if (alertChannels(type) & CHANNEL_CALL) pushAlert(type, next, true, 1, currentTime);
+}
+
+bool isReplyQueued() {
+    for (int i = 0; i < alertQueueCount; i++) {
+        if (alertQueue[i].type == ALERT_REPLY) return true;
+    }
+    return false;
+}
+
+int findQueuedAlert(AlertType type, byte recipient, bool call) {
+    for (int i = 0; i < alertQueueCount; i++) {
+        const QueuedAlert& alert = alertQueue[i];
+        if (alert.type == type && alert.recipient == recipient && alert.call == call) return i;
+    }
+    return -1;
+}
+
+// Highest priority first; the queue is in arrival order, so the oldest wins a tie
+int nextQueuedAlert() {
+    int best = 0;
+    for (int i = 1; i < alertQueueCount; i++) {
+        if (alertPriority(alertQueue[i].type) > alertPriority(alertQueue[best].type)) best = i;
+    }
+    return best;
+}
+
+void removeAlert(int index) {
+    alertQueueCount--;
+    memmove(&alertQueue[index], &alertQueue[index + 1], (alertQueueCount - index) * sizeof(QueuedAlert));
+}
+
+void pushAlert(AlertType type, byte recipient, bool call, int count, unsigned long firstTime) {
+    if (alertQueueCount == ALERT_QUEUE_SIZE) {
+        // Full: the newest entry of the lowest priority makes room, if it ranks below this one.
+        // The one in flight is already with the modem.
+        int victim = -1;
+        for (int i = 0; i < alertQueueCount; i++) {
+            if (alertQueue[i].inFlight) continue;
+            if (victim < 0 || alertPriority(alertQueue[i].type) <= alertPriority(alertQueue[victim].type)) victim = i;
+        }
+        logMessage(MSG_QUEUE_FULL);
+        if (victim < 0 || alertPriority(alertQueue[victim].type) >= alertPriority(type)) return;
+        removeAlert(victim);
+    }
+    QueuedAlert& alert = alertQueue[alertQueueCount++];
+    alert.type = type;
+    alert.recipient = recipient;
+    alert.call = call;
+    alert.count = count;
+    alert.firstTime = firstTime;
+    alert.inFlight = false;
+    alert.refusals = 0;
+}
+
+// Queues an SMS alert. Repeats of the same type are merged instead of sent again:
+// into the queued entry if it has not gone out yet, otherwise into a summary that is
+// released once ALERT_COALESCE_WINDOW has passed since that type was last sent.
+void queueAlert(AlertType type, byte recipient) {
+    unsigned long now = halMillis();
+
+    int index = findQueuedAlert(type, recipient, false);
+    if (index >= 0) {
+        alertQueue[index].count++;
+    } else if (type != ALERT_REPLY && recipient == 0 && alertEverSent[type]
+               && now - alertLastSentTime[type] < ALERT_COALESCE_WINDOW) {
+        if (alertHeldCount[type] == 0) alertHeldFirstTime[type] = now;
+        alertHeldCount[type]++;
+    } else {
+        pushAlert(type, recipient, false, 1, now);
+    }
+}
+
+bool smsRateLimited(unsigned long currentTime) {
+    if (smsRefused && currentTime - smsRefusedTime < SMS_REFUSED_RETRY) return true;
+    if (smsSentCount < SMS_MAX_PER_MINUTE) return false;
+    // smsSendTimesIndex points at the oldest of the last SMS_MAX_PER_MINUTE sends
+    return currentTime - smsSendTimes[smsSendTimesIndex] < 60000UL;
+}
+
+// True if manageAlertQueue() would send something as soon as the modem is idle
+bool isAlertWaiting(unsigned long currentTime) {
+    if (alertQueueCount == 0) return false;
+    return alertQueue[nextQueuedAlert()].call || !smsRateLimited(currentTime);
+}
+
+// Only the repeat count or ACK hint is formatted in RAM; the alert text is sent from flash
+void composeAlertSuffix(const QueuedAlert& alert, unsigned long currentTime) {
+    if (alert.recipient > 0) {
+        strcpy_P(alertSuffix, PSTR(" (escalated, reply ACK)"));
+    } else if (alert.count > 1) {
+        unsigned long minutes = (currentTime - alert.firstTime + 59999UL) / 60000UL;
+        snprintf_P(alertSuffix, SMS_SUFFIX_LENGTH, PSTR(" (x%d in last %lu min)"), alert.count, minutes);
+    } else if (alertChannels(alert.type) & CHANNEL_ESCALATE) {
+        strcpy_P(alertSuffix, PSTR(" (reply ACK)"));
+    } else {
+        alertSuffix[0] = '\0';
+    }
+}
+
+// Single GSM worker: releases held summaries, escalates unacknowledged alerts and
+// hands the most urgent queued message or call to the modem, respecting
+// SMS_MAX_PER_MINUTE for messages.
+void manageAlertQueue(unsigned long currentTime) {
+    for (int type = 0; type < ALERT_TYPE_COUNT; type++) {
+        if (alertHeldCount[type] > 0 && currentTime - alertLastSentTime[type] >= ALERT_COALESCE_WINDOW) {
+            pushAlert((AlertType)type, 0, false, alertHeldCount[type], alertHeldFirstTime[type]);
+            alertHeldCount[type] = 0;
+        }
+    }
+    if (escalation.type != ALERT_TYPE_COUNT && currentTime - escalation.time >= ESCALATION_INTERVAL) {
+        escalateAlert(currentTime);
+    }
+
+    if (alertQueueCount == 0 || gsmState != GSM_READY) return;
+
+    int index = nextQueuedAlert();
+    QueuedAlert& alert = alertQueue[index];
+    const char* number = config.phoneNumbers[alert.recipient];
+    if (alert.call) {
+        placeCall(number);
+        removeAlert(index);
+        return;
+    }
+    if (smsRateLimited(currentTime)) return;
+
+    composeAlertSuffix(alert, currentTime);
+    MessageId text = (MessageId)pgm_read_byte(&ALERT_POLICIES[alert.type].message);
+    const char* suffix = alert.type == ALERT_REPLY ? smsReplyText : alertSuffix;
+    if (!sendSMS(number, messageText(text), suffix)) return;
+
+    // It stays queued until the modem confirms it: a failed send is tried again
+    alert.inFlight = true;
+    inFlightCount = alert.count;
+}
+
+int findInFlightAlert() {
+    for (int i = 0; i < alertQueueCount; i++) {
+        if (alertQueue[i].inFlight) return i;
+    }
+    return -1;
+}
+
+// +CMGS: the SMS went out. Repeats merged into the entry after it was composed
+// were not in its text, so they are held for the next summary.
+void confirmAlertSent(unsigned long currentTime) {
+    smsRefused = false;
+    smsSendTimes[smsSendTimesIndex] = currentTime;
+    smsSendTimesIndex = (smsSendTimesIndex + 1) % SMS_MAX_PER_MINUTE;
+    if (smsSentCount < SMS_MAX_PER_MINUTE) smsSentCount++;
+
+    int index = findInFlightAlert();
+    if (index < 0) return; // Dropped by an ACK while it was going out
+    const QueuedAlert& alert = alertQueue[index];
+    if (alert.recipient == 0) {
+        alertEverSent[alert.type] = true;
+        alertLastSentTime[alert.type] = currentTime;
+        int repeats = alert.count - inFlightCount;
+        if (repeats > 0 && alert.type != ALERT_REPLY) {
+            if (alertHeldCount[alert.type] == 0) alertHeldFirstTime[alert.type] = currentTime;
+            alertHeldCount[alert.type] += repeats;
+        }
+    }
+    removeAlert(index);
+}
+
+// The modem is there but answered ERROR, so trying again at once would only
+// repeat it: the next SMS waits SMS_REFUSED_RETRY, and a message refused
+// SMS_MAX_REFUSALS times is dropped. A modem that does not answer at all
+// costs nothing here; the alert waits for it to come back.
+void refuseAlertInFlight(unsigned long currentTime) {
+    smsRefused = true;
+    smsRefusedTime = currentTime;
+    int index = findInFlightAlert();
+    if (index < 0 || ++alertQueue[index].refusals < SMS_MAX_REFUSALS) return;
+    logMessage(MSG_SMS_DROPPED);
+    removeAlert(index);
+}
+
+// The send failed: the entry keeps its place and priority for the next attempt
+void releaseAlertInFlight() {
+    int index = findInFlightAlert();
+    if (index >= 0) alertQueue[index].inFlight = false;
+}
+
+// --- GSM FUNCTIONS ---
+// Starts sending an SMS. Returns false if another message is still going out.
+// The transaction itself is driven by manageGSM() from loop(). number
+// is a RAM string from config.phoneNumbers, message is a PROGMEM string and suffix
+// is an optional RAM string appended to the message.
+bool sendSMS(const char* number, const char* message, const char* suffix) {
+    if (gsmState != GSM_READY) {
+        logMessage(MSG_GSM_BUSY);
+        return false;
+    }
+
+    console.print(messageF(MSG_SMS_SENDING));
+    console.println(number);
+
+    gsm.print(F("AT+CMGS=\""));
+    gsm.print(number);
+    gsm.println(F("\""));
+
+    smsMessage = message;
+    smsSuffix = suffix;
+    setGsmState(GSM_WAIT_PROMPT);
+    return true;
+}
+
+// Rings number for CALL_RING_TIME and hangs up. Nobody has to answer: the ring
+// is the alert, and the ACK still comes by SMS.
+void placeCall(const char* number) {
+    console.print(messageF(MSG_CALLING));
+    console.println(number);
+    gsm.print(F("ATD"));
+    gsm.print(number);
+    gsm.println(F(";")); // Trailing ';' makes it a voice call
+    setGsmState(GSM_CALL_DIAL);
+}
+
+void hangUpCall() {
+    gsm.println(F("ATH"));
+    setGsmState(GSM_CALL_HANGUP);
+}
+
+void finishCall(bool success) {
+    logMessage(success ? MSG_CALL_ENDED : MSG_CALL_FAILED);
+    setGsmState(GSM_READY);
+}
+
+// Room in GsmTxQueue on SoftwareSerial, in the UART's TX buffer otherwise
+int gsmTxRoom() {
+    return gsm.availableForWrite();
+}
+
+void setGsmState(GsmState state) {
+    gsmState = state;
+    gsmStateStartTime = halMillis();
+}
+
+void resetATLine() {
+    atLineLength = 0;
+    atCandidates = AT_ALL_KEYWORDS;
+    atInNumber = false;
+}
+
+// Narrows the keyword candidates with the character at position atLineLength.
+void matchATChar(char c) {
+    for (unsigned int k = 0; k < AT_KEYWORD_COUNT; k++) {
+        if (!(atCandidates & (1UL << k))) continue;
+        const AtKeyword* keyword = &AT_KEYWORDS[k];
+        int keywordLength = strlen_P(keyword->text);
+        bool matches = atLineLength < keywordLength ? (char)pgm_read_byte(&keyword->text[atLineLength]) == c
+                                                    : pgm_read_byte(&keyword->isPrefix);
+        if (!matches) atCandidates &= ~(1UL << k);
+    }
+
+    if (c >= '0' && c <= '9') {
+        if (!atInNumber) atNumber = 0;
+        atNumber = atNumber * 10 + (c - '0');
+        atInNumber = true;
+    } else {
+        atInNumber = false;
+    }
+}
+
+AtResponse classifyATLine() {
+    for (unsigned int k = 0; k < AT_KEYWORD_COUNT; k++) {
+        if ((atCandidates & (1UL << k)) && atLineLength >= (int)strlen_P(AT_KEYWORDS[k].text)) {
+            return (AtResponse)pgm_read_byte(&AT_KEYWORDS[k].response);
+        }
+    }
+    return AT_LINE;
+}
+
+// Streams modem bytes through the tokenizer and returns as soon as one response
+// is recognised, or AT_NONE once the receive buffer is empty. The text of the
+// last line stays in atLine and its numeric field in atNumber.
+AtResponse readATResponse() {
+    while (gsm.available()) {
+        char c = gsm.read();
+
+        if (c == '\r') continue;
+        if (c == '\n') {
+            // An SMS body is taken as it is: a parent may well text "OK", or an empty message
+            if (atLineLength == 0 && !smsBodyNext) continue; // Skip blank lines
+            AtResponse response = smsBodyNext ? AT_SMS_BODY : classifyATLine();
+            smsBodyNext = false;
+            atLine[min(atLineLength, AT_LINE_LENGTH - 1)] = '\0';
+            resetATLine();
+            return response;
+        }
+        if (atLineLength == 0 && !smsBodyNext) {
+            // The SMS prompt is "> " with no line ending, so it is matched on its own
+            if (c == '>') return AT_PROMPT;
+            if (c == ' ') continue;
+            atNumber = 0;
+        }
+
+        matchATChar(c);
+        if (atLineLength < AT_LINE_LENGTH - 1) atLine[atLineLength] = c;
+        atLineLength++;
+    }
+    return AT_NONE;
+}
+
+void handleATResponse(AtResponse response) {
+    switch (response) {
+        case AT_OK:
+            if (gsmState == GSM_PROBE && GSM_FAST_BAUD != 0 && gsmBaud != GSM_FAST_BAUD) {
+                gsm.print(F("AT+IPR="));
+                gsm.println(GSM_FAST_BAUD);
+                setGsmState(GSM_SET_BAUD);
+            } else if (gsmState == GSM_PROBE) {
+                gsm.println(F("AT+CMGF=1")); // Set to text mode
+                setGsmState(GSM_CONFIGURE);
+            } else if (gsmState == GSM_SET_BAUD) {
+                // The modem answers at the old rate, then switches: follow it and probe again
+                setGsmBaud(GSM_FAST_BAUD);
+                gsm.println(F("AT"));
+                setGsmState(GSM_PROBE);
+            } else if (gsmState == GSM_CONFIGURE && gsmClearSim) {
+                gsm.println(F("AT+CMGD=1,4")); // Delete every stored message, read or not
+                setGsmState(GSM_CLEAR_SIM);
+            } else if (gsmState == GSM_CONFIGURE || gsmState == GSM_CLEAR_SIM) {
+                if (gsmState == GSM_CLEAR_SIM) {
+                    gsmClearSim = false;
+                    logMessage(MSG_SIM_CLEARED);
+                }
+                enableSMSNotify();
+            } else if (gsmState == GSM_SET_NOTIFY) {
+                if (!gsmConnected) logMessage(MSG_GSM_READY);
+                gsmConnected = true;
+                setGsmState(GSM_READY);
+            } else if (gsmState == GSM_READ_SMS) {
+                processInboundSMS();
+            } else if (gsmState == GSM_DELETE_SMS) {
+                finishInboundSMS();
+            } else if (gsmState == GSM_CALL_DIAL) {
+                setGsmState(GSM_CALL_RINGING); // Voice ATD answers OK once it starts dialling
+            } else if (gsmState == GSM_CALL_HANGUP) {
+                finishCall(true);
+#if ENABLE_TELEMETRY
+            } else if (gsmState == GSM_LINK_RXMODE) {
+                gsm.print(F("AT+CSTT=\""));
+                gsm.print((const __FlashStringHelper*)TELEMETRY_APN);
+                gsm.println(F("\""));
+                setGsmState(GSM_LINK_APN);
+            } else if (gsmState == GSM_LINK_APN) {
+                gsm.println(F("AT+CIICR")); // Attach to GPRS and activate the PDP context
+                setGsmState(GSM_LINK_ATTACH);
+            } else if (gsmState == GSM_LINK_ATTACH) {
+                gsm.println(F("AT+CIFSR")); // Answers with the local IP and no OK
+                setGsmState(GSM_LINK_ADDRESS);
+#endif
+            }
+            break;
+
+        case AT_PROMPT:
+            if (gsmState == GSM_WAIT_PROMPT) {
+                smsNextChar = smsMessage;
+                smsInSuffix = false;
+                setGsmState(GSM_WRITE_BODY);
+#if ENABLE_TELEMETRY
+            } else if (gsmState == GSM_DATA_PROMPT) {
+                telemetryDataNext = 0;
+                setGsmState(GSM_WRITE_DATA);
+#endif
+            }
+            break;
+
+        case AT_CMGS:
+            if (gsmState == GSM_WAIT_RESULT) finishSMS(true);
+            break;
+
+        case AT_ERROR:
+            if (gsmState == GSM_SET_BAUD) {
+                gsm.println(F("AT+CMGF=1")); // Rate not supported: carry on at this one
+                setGsmState(GSM_CONFIGURE);
+            } else if (gsmState == GSM_CLEAR_SIM) {
+                enableSMSNotify(); // Tried again at the next bring-up
+            } else if (gsmState >= GSM_WAIT_PROMPT && gsmState <= GSM_WAIT_RESULT) {
+                refuseAlertInFlight(halMillis());
+                finishSMS(false);
+            } else if (gsmState == GSM_READ_SMS) {
+                deleteInboundSMS(); // Unreadable slot: clear it anyway
+            } else if (gsmState == GSM_DELETE_SMS) {
+                finishInboundSMS();
+            } else if (gsmState == GSM_CALL_DIAL) {
+                finishCall(false);
+            } else if (gsmState == GSM_CALL_HANGUP) {
+                finishCall(true); // Nothing left to hang up
+#if ENABLE_TELEMETRY
+            } else if (gsmState >= GSM_LINK_SHUT && gsmState <= GSM_LINK_CONNECT) {
+                failTelemetryLink();
+            } else if (gsmState >= GSM_DATA_PROMPT && gsmState <= GSM_DATA_RESULT) {
+                finishDataSend(false);
+#endif
+            }
+            break;
+
+        case AT_CALL_ENDED:
+            if (gsmState == GSM_CALL_DIAL || gsmState == GSM_CALL_RINGING) finishCall(true);
+            break;
+
+#if ENABLE_TELEMETRY
+        case AT_SHUT_OK:
+            if (gsmState == GSM_LINK_SHUT) {
+                if (isAlertWaiting(halMillis())) {
+                    setGsmState(GSM_READY); // Link aborted: the alert goes first
+                } else {
+                    gsm.println(F("AT+CIPRXGET=1")); // Hold received data in the modem: the broker's
+                    setGsmState(GSM_LINK_RXMODE);    // replies never reach the line parser
+                }
+            }
+            break;
+
+        case AT_CONNECT:
+            if (gsmState == GSM_LINK_CONNECT) sendMqttConnect();
+            break;
+
+        case AT_SEND_OK:
+            if (gsmState == GSM_DATA_RESULT) finishDataSend(true);
+            break;
+
+        case AT_CLOSED:
+            telemetryLinkUp = false;
+            if (gsmState >= GSM_DATA_PROMPT && gsmState <= GSM_DATA_RESULT) finishDataSend(false);
+            break;
+#endif
+
+        case AT_CMTI:
+            console.print(messageF(MSG_SMS_RECEIVED));
+            console.println(atNumber);
+            queueInboundSMS(atNumber);
+            break;
+
+        case AT_CMGR:
+            if (gsmState == GSM_READ_SMS) {
+                parseSMSSender();
+                smsBodyNext = true;
+            }
+            break;
+
+        case AT_SMS_BODY:
+            if (gsmState == GSM_READ_SMS) {
+                strncpy(smsCommand, atLine, SMS_COMMAND_LENGTH - 1);
+                smsCommand[SMS_COMMAND_LENGTH - 1] = '\0';
+            }
+            break;
+
+#if ENABLE_TELEMETRY
+        case AT_LINE:
+            if (gsmState == GSM_LINK_ADDRESS && isdigit(atLine[0])) {
+                connectTelemetryBroker(); // Got an IP address (the echo starts with "AT")
+            }
+            break;
+#endif
+
+        default:
+            break; // Echoes and other unsolicited lines
+    }
+}
+
+// (Re)starts modem bring-up. Used at boot, after a failed bring-up and whenever
+// the modem stops answering, so a dropped modem never needs a board reset.
+void probeGSM() {
+    gsmProbeAttempts = 1;
+    sendGSMProbe();
+}
+
+// A modem that was switched to GSM_FAST_BAUD keeps that rate until it is power
+// cycled, so retries alternate between the two rates
+void enableSMSNotify() {
+    gsm.println(F("AT+CNMI=2,1,0,0,0")); // Announce new SMS with +CMTI
+    setGsmState(GSM_SET_NOTIFY);
+}
+
+void sendGSMProbe() {
+    if (GSM_FAST_BAUD != 0 && gsmProbeAttempts > 1) {
+        setGsmBaud(gsmBaud == GSM_BAUD ? GSM_FAST_BAUD : GSM_BAUD);
+    }
+    gsm.println(F("AT"));
+    setGsmState(GSM_PROBE);
+}
+
+void setGsmBaud(unsigned long baud) {
+    if (baud == gsmBaud) return;
+    gsm.flush(); // Let the last command leave at the old rate
+    halGsmBegin(baud);
+    gsmBaud = baud;
+}
+
+// Next body character: the flash message, then the RAM suffix, then '\0'
+char nextSMSChar() {
+    if (!smsInSuffix) {
+        char c = pgm_read_byte(smsNextChar);
+        if (c != '\0') {
+            smsNextChar++;
+            return c;
+        }
+        smsInSuffix = true;
+        smsNextChar = smsSuffix != NULL ? smsSuffix : "";
+    }
+    return *smsNextChar != '\0' ? *smsNextChar++ : '\0';
+}
+
+void finishSMS(bool success) {
+    logMessage(success ? MSG_SMS_SENT : MSG_SMS_FAILED);
+    smsMessage = NULL;
+    if (success) {
+        confirmAlertSent(halMillis());
+        setGsmState(GSM_READY);
+    } else {
+        releaseAlertInFlight();
+        probeGSM(); // Check the modem is still there; the alert goes out once it answers
+    }
+}
+
+void manageGSM(unsigned long currentTime) {
+    AtResponse response;
+    while ((response = readATResponse()) != AT_NONE) {
+        gsmAnswerTime = currentTime;
+        handleATResponse(response);
+    }
+#if ENABLE_TELEMETRY
+    // An alert never waits for the uplink. The only exception is GSM_WRITE_DATA:
+    // the modem takes anything sent then as payload, and the write is over in a few passes.
+    if (gsmState > GSM_LINK_SHUT && gsmState <= GSM_DATA_RESULT && gsmState != GSM_WRITE_DATA
+        && isAlertWaiting(currentTime)) {
+        abortTelemetryLink();
+    }
+#endif
+
+    switch (gsmState) {
+        case GSM_POWER_UP:
+            if (currentTime - gsmStateStartTime >= GSM_BOOT_TIME) {
+                logMessage(MSG_GSM_INIT);
+                probeGSM();
+            }
+            break;
+
+        case GSM_PROBE:
+        case GSM_SET_BAUD:
+        case GSM_CONFIGURE:
+        case GSM_SET_NOTIFY:
+            if (currentTime - gsmStateStartTime > GSM_PROBE_TIMEOUT) {
+                if (gsmProbeAttempts < GSM_PROBE_ATTEMPTS) {
+                    logMessage(MSG_GSM_RETRY);
+                    gsmProbeAttempts++;
+                    sendGSMProbe();
+                } else {
+                    logMessage(MSG_GSM_FAILED);
+                    gsmConnected = false;
+                    gsmClearSim = true; // The modem may have been power cycled
+#if ENABLE_TELEMETRY
+                    telemetryLinkUp = false; // The modem may have been power cycled
+#endif
+                    setGsmState(GSM_OFFLINE);
+                }
+            }
+            break;
+
+        case GSM_CLEAR_SIM:
+            // Deleting a full SIM takes a few seconds; not answering is not fatal
+            if (currentTime - gsmStateStartTime > GSM_PROMPT_TIMEOUT) enableSMSNotify();
+            break;
+
+        case GSM_OFFLINE:
+            if (currentTime - gsmStateStartTime >= GSM_RETRY_INTERVAL) {
+                probeGSM();
+            }
+            break;
+
+        case GSM_READY:
+            if (smsInboxCount > 0) {
+                // Its reply would overwrite smsReplyText: wait for the queued one to go out
+                if (!isReplyQueued()) readInboundSMS();
+            } else if (currentTime - gsmAnswerTime >= GSM_HEALTH_CHECK_INTERVAL) {
+                probeGSM();
+#if ENABLE_TELEMETRY
+            } else if (startTelemetryTransfer(currentTime)) {
+                // Link bring-up or a frame upload is now in progress
+#endif
+            }
+            break;
+
+        case GSM_WAIT_PROMPT:
+            if (currentTime - gsmStateStartTime > GSM_PROMPT_TIMEOUT) {
+                gsm.write(27); // ESC aborts the pending AT+CMGS
+                finishSMS(false);
+            }
+            break;
+
+        case GSM_WRITE_BODY:
+            // Hand over only as much of the body as the TX queue or the UART buffer
+            // has room for, so loop() keeps its cycle time.
+            for (int room = gsmTxRoom(); room > 0; room--) {
+                char c = nextSMSChar();
+                if (c == '\0') {
+                    gsm.write(26); // ASCII for Ctrl+Z to send the message
+                    setGsmState(GSM_WAIT_RESULT);
+                    break;
+                }
+                gsm.write(c);
+            }
+            break;
+
+        case GSM_WAIT_RESULT:
+            if (currentTime - gsmStateStartTime > GSM_RESULT_TIMEOUT) {
+                finishSMS(false);
+            }
+            break;
+
+        case GSM_READ_SMS:
+        case GSM_DELETE_SMS:
+            if (currentTime - gsmStateStartTime > GSM_PROMPT_TIMEOUT) {
+                smsInboxHead = (smsInboxHead + 1) % SMS_INBOX_SIZE; // Give up on this one
+                smsInboxCount--;
+                smsBodyNext = false;
+                probeGSM();
+            }
+            break;
+
+        case GSM_CALL_DIAL:
+            if (currentTime - gsmStateStartTime > GSM_PROMPT_TIMEOUT) hangUpCall();
+            break;
+
+        case GSM_CALL_RINGING:
+            if (currentTime - gsmStateStartTime > CALL_RING_TIME) hangUpCall();
+            break;
+
+        case GSM_CALL_HANGUP:
+            if (currentTime - gsmStateStartTime > GSM_PROMPT_TIMEOUT) finishCall(true);
+            break;
+
+#if ENABLE_TELEMETRY
+        case GSM_LINK_SHUT:
+        case GSM_LINK_RXMODE:
+        case GSM_LINK_APN:
+        case GSM_LINK_ADDRESS:
+            if (currentTime - gsmStateStartTime > GSM_PROMPT_TIMEOUT) failTelemetryLink();
+            break;
+
+        case GSM_LINK_ATTACH:
+            if (currentTime - gsmStateStartTime > GPRS_ATTACH_TIMEOUT) failTelemetryLink();
+            break;
+
+        case GSM_LINK_CONNECT:
+            if (currentTime - gsmStateStartTime > TCP_CONNECT_TIMEOUT) failTelemetryLink();
+            break;
+
+        case GSM_DATA_PROMPT:
+            if (currentTime - gsmStateStartTime > GSM_PROMPT_TIMEOUT) {
+                gsm.write(27); // ESC aborts the pending AT+CIPSEND
+                finishDataSend(false);
+            }
+            break;
+
+        case GSM_WRITE_DATA:
+            // Binary data: the length announced in AT+CIPSEND ends it, not Ctrl+Z
+            for (int room = gsmTxRoom(); room > 0; room--) {
+                if (telemetryDataNext == telemetryHeadLength + telemetryBodyLength) {
+                    setGsmState(GSM_DATA_RESULT);
+                    break;
+                }
+                gsm.write(nextDataByte());
+            }
+            break;
+
+        case GSM_DATA_RESULT:
+            if (currentTime - gsmStateStartTime > TCP_SEND_TIMEOUT) finishDataSend(false);
+            break;
+#endif
+    }
+
+#if GSM_PORT == GSM_PORT_SOFTWARE
+    gsm.send(GSM_TX_CHUNK); // Including what this pass queued, so a command starts at once
+#endif
+}
+
+// --- TELEMETRY ---
+#if ENABLE_TELEMETRY
+void putTelemetryWord(int value) {
+    telemetryFrame[telemetryFrameLength++] = (unsigned int)value >> 8;
+    telemetryFrame[telemetryFrameLength++] = value & 0xFF;
+}
+
+// Encodes a sample into the frame. Returns false if the frame has no room left.
+bool appendTelemetrySample(const TelemetrySample& sample, unsigned long sampleTime) {
+    if (telemetryFrameLength == 0) {
+        unsigned long uptime = sampleTime / 1000;
+        telemetryFrame[0] = TELEMETRY_FRAME_VERSION;
+        telemetryFrame[1] = TELEMETRY_SAMPLE_INTERVAL / 1000;
+        telemetryFrame[2] = 0;
+        for (byte i = 0; i < 4; i++) telemetryFrame[3 + i] = uptime >> (24 - 8 * i);
+        telemetryFrameLength = TELEMETRY_FRAME_HEADER;
+        for (byte field = 0; field < FIELD_COUNT; field++) putTelemetryWord(sample.values[field]);
+    } else {
+        if (telemetryFrameLength + TELEMETRY_SAMPLE_MAX > TELEMETRY_FRAME_SIZE || telemetryFrame[2] == 255) {
+            return false;
+        }
+        byte maskIndex = telemetryFrameLength++;
+        byte mask = 0;
+        for (byte field = 0; field < FIELD_COUNT; field++) {
+            long delta = (long)sample.values[field] - telemetryLast.values[field];
+            if (delta == 0) continue;
+            mask |= 1 << field;
+            if (delta > -128 && delta < 128) {
+                telemetryFrame[telemetryFrameLength++] = (byte)delta;
+            } else {
+                telemetryFrame[telemetryFrameLength++] = TELEMETRY_ESCAPE;
+                putTelemetryWord(sample.values[field]);
+            }
+        }
+        telemetryFrame[maskIndex] = mask;
+    }
+    telemetryLast = sample;
+    telemetryFrame[2]++;
+    return true;
+}
+
+void addTelemetrySample(const TelemetrySample& sample, unsigned long sampleTime) {
+    if (appendTelemetrySample(sample, sampleTime)) return;
+    // Full because the link has been down for a while: start over from this sample
+    logMessage(MSG_FRAME_DROPPED);
+    telemetryFramesDropped++;
+    telemetryFrameLength = 0;
+    appendTelemetrySample(sample, sampleTime);
+}
+
+// Called while the modem is idle. Brings the link up or publishes the frame once
+// a batch is complete; a waiting SMS alert always gets the modem first.
+bool startTelemetryTransfer(unsigned long currentTime) {
+    if (telemetryFrameLength == 0 || telemetryFrame[2] < TELEMETRY_BATCH) return false;
+    if (isAlertWaiting(currentTime)) return false;
+
+    if (!telemetryLinkUp) {
+        if (telemetryRetrying && currentTime - telemetryRetryTime < TELEMETRY_RETRY_INTERVAL) return false;
+        telemetryRetrying = false;
+        gsm.println(F("AT+CIPSHUT")); // Start from a closed connection and PDP context
+        setGsmState(GSM_LINK_SHUT);
+        return true;
+    }
+
+    byte topicLength = strlen_P(TELEMETRY_TOPIC);
+    telemetryHead[0] = MQTT_PUBLISH;
+    telemetryHead[1] = 2 + topicLength + telemetryFrameLength; // Remaining length
+    telemetryHead[2] = 0;
+    telemetryHead[3] = topicLength;
+    memcpy_P(telemetryHead + 4, TELEMETRY_TOPIC, topicLength);
+    telemetrySending = true;
+    startDataSend(4 + topicLength, telemetryFrame, telemetryFrameLength);
+    return true;
+}
+
+void connectTelemetryBroker() {
+    gsm.print(F("AT+CIPSTART=\"TCP\",\""));
+    gsm.print((const __FlashStringHelper*)TELEMETRY_BROKER);
+    gsm.print(F("\","));
+    gsm.println(TELEMETRY_BROKER_PORT);
+    setGsmState(GSM_LINK_CONNECT);
+}
+
+void sendMqttConnect() {
+    byte idLength = strlen_P(TELEMETRY_CLIENT_ID);
+    byte length = 0;
+    telemetryHead[length++] = MQTT_CONNECT;
+    telemetryHead[length++] = sizeof(MQTT_CONNECT_HEADER) + 2 + idLength; // Remaining length
+    memcpy_P(telemetryHead + length, MQTT_CONNECT_HEADER, sizeof(MQTT_CONNECT_HEADER));
+    length += sizeof(MQTT_CONNECT_HEADER);
+    telemetryHead[length++] = 0;
+    telemetryHead[length++] = idLength;
+    memcpy_P(telemetryHead + length, TELEMETRY_CLIENT_ID, idLength);
+    length += idLength;
+    telemetryConnecting = true;
+    startDataSend(length, NULL, 0);
+}
+
+// Sends telemetryHead followed by body as one TCP segment
+void startDataSend(byte headLength, const byte* body, byte bodyLength) {
+    telemetryHeadLength = headLength;
+    telemetryBody = body;
+    telemetryBodyLength = bodyLength;
+    gsm.print(F("AT+CIPSEND="));
+    gsm.println(headLength + bodyLength);
+    setGsmState(GSM_DATA_PROMPT);
+}
+
+byte nextDataByte() {
+    byte index = telemetryDataNext++;
+    return index < telemetryHeadLength ? telemetryHead[index] : telemetryBody[index - telemetryHeadLength];
+}
+
+void finishDataSend(bool success) {
+    if (success) {
+        telemetryBytesSent += telemetryHeadLength + telemetryBodyLength;
+        if (telemetryConnecting) {
+            telemetryLinkUp = true;
+            logMessage(MSG_LINK_UP);
+        } else if (telemetrySending) {
+            telemetryFramesSent++;
+            telemetryFrameLength = 0;
+        }
+    } else {
+        telemetryLinkUp = false;
+        telemetryRetrying = true;
+        telemetryRetryTime = halMillis();
+        logMessage(MSG_LINK_FAILED); // A failed frame stays buffered for the next attempt
+    }
+    endDataSend();
+    setGsmState(GSM_READY);
+}
+
+void endDataSend() {
+    telemetryConnecting = false;
+    telemetrySending = false;
+    if (telemetryPendingValid) {
+        telemetryPendingValid = false;
+        addTelemetrySample(telemetryPending, telemetryPendingTime);
+    }
+}
+
+// Closes the link so a queued alert can have the modem. The modem is only handed
+// over once it has answered SHUT OK (see handleATResponse()), so no late reply to
+// a link command is mistaken for the alert's. A frame waiting for SEND OK stays
+// buffered and is published again later.
+void abortTelemetryLink() {
+    if (gsmState == GSM_DATA_PROMPT) gsm.write(27); // ESC aborts the pending AT+CIPSEND
+    gsm.println(F("AT+CIPSHUT"));
+    telemetryLinkUp = false;
+    endDataSend();
+    setGsmState(GSM_LINK_SHUT);
+}
+
+void failTelemetryLink() {
+    logMessage(MSG_LINK_FAILED);
+    telemetryLinkUp = false;
+    telemetryRetrying = true;
+    telemetryRetryTime = halMillis();
+    setGsmState(GSM_READY);
+}
+
+void printTelemetryReport() {
+    console.print(F("Link: "));
+    console.println(telemetryLinkUp ? F("up") : F("down"));
+    console.print(F("Frames sent: "));
+    console.println(telemetryFramesSent);
+    console.print(F("Frames dropped: "));
+    console.println(telemetryFramesDropped);
+    console.print(F("Bytes sent: "));
+    console.println(telemetryBytesSent);
+    console.print(F("Samples buffered: "));
+    console.println(telemetryFrameLength > 0 ? telemetryFrame[2] : 0);
+}
+#endif
+
+// --- INBOUND SMS COMMANDS ---
+void queueInboundSMS(long index) {
+    if (smsInboxCount == SMS_INBOX_SIZE) {
+        logMessage(MSG_INBOX_FULL);
+        gsmClearSim = true; // Never read: it would fill the SIM
+        return;
+    }
+    smsInbox[(smsInboxHead + smsInboxCount) % SMS_INBOX_SIZE] = index;
+    smsInboxCount++;
+}
+
+void readInboundSMS() {
+    smsBodyNext = false;
+    smsSender[0] = '\0';
+    smsCommand[0] = '\0';
+    gsm.print(F("AT+CMGR="));
+    gsm.println(smsInbox[smsInboxHead]);
+    setGsmState(GSM_READ_SMS);
+}
+
+// +CMGR: "REC UNREAD","+911234567890","","24/01/01,12:00:00+22"
+void parseSMSSender() {
+    const char* start = strstr_P(atLine, PSTR("\",\""));
+    if (start == NULL) return;
+    start += 3;
+    byte length = 0;
+    while (start[length] != '\0' && start[length] != '"' && length < PHONE_NUMBER_LENGTH - 1) {
+        smsSender[length] = start[length];
+        length++;
+    }
+    smsSender[length] = '\0';
+}
+
+int findRecipient(const char* number) {
+    for (byte i = 0; i < ALERT_RECIPIENTS; i++) {
+        if (config.phoneNumbers[i][0] != '\0' && strcmp(number, config.phoneNumbers[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Called on the OK that ends the AT+CMGR response
+void processInboundSMS() {
+    int sender = findRecipient(smsSender);
+    if (sender < 0) {
+        console.print(messageF(MSG_SMS_IGNORED));
+        console.println(smsSender);
+    } else if (smsCommand[0] != '\0') {
+        console.print(messageF(MSG_SMS_COMMAND));
+        console.println(smsCommand);
+        smsReplyRecipient = sender;
+        handleSMSCommand(smsCommand);
+    }
+    deleteInboundSMS();
+}
+
+void deleteInboundSMS() {
+    gsm.print(F("AT+CMGD="));
+    gsm.println(smsInbox[smsInboxHead]);
+    setGsmState(GSM_DELETE_SMS);
+}
+
+void finishInboundSMS() {
+    smsInboxHead = (smsInboxHead + 1) % SMS_INBOX_SIZE;
+    smsInboxCount--;
+    setGsmState(GSM_READY);
+}
+
+void replyMessage(MessageId id) {
+    strncpy_P(smsReplyText, messageText(id), SMS_REPLY_LENGTH - 1);
+    smsReplyText[SMS_REPLY_LENGTH - 1] = '\0';
+}
+
+void composeStatusReply() {
+    char temperature[8];
+    char humidity[5] = "--";
+    if (isnan(lastTemperature)) {
+        strcpy_P(temperature, messageText(MSG_LCD_NO_READING));
+    } else {
+        dtostrf(lastTemperature, 1, 1, temperature);
+        itoa((int)lastHumidity, humidity, 10);
+    }
+    snprintf_P(smsReplyText, SMS_REPLY_LENGTH, PSTR("temp %sC %s%%, fan " PRI_PSTR ", " PRI_PSTR ", diaper " PRI_PSTR ", cradle " PRI_PSTR),
+               temperature, humidity,
+               isFanOn ? PSTR("on") : PSTR("off"),
+               isCrying ? PSTR("crying") : PSTR("calm"),
+               isDiaperAlertActive ? PSTR("wet") : PSTR("dry"),
+               isCradleSwinging() ? PSTR("swinging") : PSTR("idle"));
+}
+
+// Commands from the parent's phone; every one is answered through the alert queue
+void handleSMSCommand(char* command) {
+    // Phones like to add a trailing space or newline
+    int length = strlen(command);
+    while (length > 0 && isspace(command[length - 1])) command[--length] = '\0';
+
+    if (strcasecmp_P(command, PSTR("STATUS")) == 0) {
+        composeStatusReply();
+    } else if (strcasecmp_P(command, PSTR("TREND")) == 0) {
+        composeTrendReply();
+    } else if (strcasecmp_P(command, PSTR("SWING")) == 0) {
+        startDefaultSwing();
+        replyMessage(MSG_REPLY_SWINGING);
+    } else if (strcasecmp_P(command, PSTR("FAN ON")) == 0) {
+        overrideFan(FAN_FORCED_ON);
+        replyMessage(MSG_REPLY_FAN_ON);
+    } else if (strcasecmp_P(command, PSTR("FAN OFF")) == 0) {
+        overrideFan(FAN_FORCED_OFF);
+        replyMessage(MSG_REPLY_FAN_OFF);
+    } else if (strcasecmp_P(command, PSTR("FAN AUTO")) == 0) {
+        overrideFan(FAN_AUTO);
+        replyMessage(MSG_REPLY_FAN_AUTO);
+    } else if (strcasecmp_P(command, PSTR("MUTE")) == 0) {
+        muteBuzzer();
+        replyMessage(MSG_REPLY_MUTED);
+    } else if (strcasecmp_P(command, PSTR("ACK")) == 0) {
+        replyMessage(acknowledgeAlert(smsReplyRecipient) ? MSG_REPLY_ACK : MSG_REPLY_NO_ALERT);
+    } else if (strncasecmp_P(command, PSTR("SET "), 4) == 0) {
+        replyMessage(applyConfigSetting(command + 4) ? MSG_CONFIG_UPDATED : MSG_CONFIG_INVALID);
+        if (smsReplyText[strlen(smsReplyText) - 1] == ' ') {
+            strncat(smsReplyText, command + 4, SMS_REPLY_LENGTH - strlen(smsReplyText) - 1);
+        }
+    } else {
+        replyMessage(MSG_UNKNOWN_COMMAND);
+        strncat(smsReplyText, command, SMS_REPLY_LENGTH - strlen(smsReplyText) - 1);
+    }
+    queueAlert(ALERT_REPLY, smsReplyRecipient);
+}
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""Turns the sketch into a C++ translation unit for the host build.
+
+The Arduino builder declares every function of a sketch at the top before
+compiling it, so the sketch may call functions defined further down. This does
+the same: it preprocesses the sketch with the host flags (so only the functions
+of the active #if branches are seen, with macros such as HAL_ISR_ATTR expanded),
+collects the top-level function definitions, and inserts their prototypes just
+before the first one, where all the types they use are already declared.
+
+    gen_sketch.py --cxx g++ --output sketch.cpp backedcode.c -- -DHAL_HOST=1 -Ihost
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+LINE_MARKER = re.compile(r'^# (\d+) "(.*)"')
+DEFINITION = re.compile(
+    r'^(?P<head>(?:(?:static|inline|const|unsigned|signed|volatile)\s+)*'
+    r'[A-Za-z_][\w:<>]*[\s*&]+(?:[*&]\s*)*)'
+    r'(?P<name>[A-Za-z_]\w*)\s*\((?P<args>[^;{}]*)\)\s*\{')
+NOT_FUNCTIONS = {'if', 'for', 'while', 'switch', 'return', 'sizeof'}
+NOT_TYPES = ('struct', 'class', 'enum', 'union', 'typedef', 'namespace', 'else', 'return')
+
+
+def strip_code(line):
+    """Drops string and character literals and comments before braces are counted."""
+    line = re.sub(r'"(\\.|[^"\\])*"', '""', line)
+    line = re.sub(r"'(\\.|[^'\\])*'", "''", line)
+    return re.sub(r'//.*', '', line)
+
+
+def strip_defaults(args):
+    """Default arguments may only be given once: drop them from the prototype."""
+    return re.sub(r'\s*=\s*[^,]+', '', args)
+
+
+def preprocess(cxx, flags, source):
+    result = subprocess.run([cxx, '-E', '-x', 'c++'] + flags + [source],
+                            capture_output=True, text=True)
+    if result.returncode != 0:
+        sys.stderr.write(result.stderr)
+        sys.exit(result.returncode)
+    return result.stdout.split('\n')
+
+
+def find_definitions(lines, source):
+    """Yields (sketch line number, prototype) for each top-level function definition."""
+    source = os.path.realpath(source)
+    in_sketch = False
+    line_number = 0
+    depth = 0
+    for line in lines:
+        marker = LINE_MARKER.match(line)
+        if marker:
+            line_number = int(marker.group(1))
+            in_sketch = os.path.realpath(marker.group(2)) == source
+            continue
+        if in_sketch and depth == 0:
+            match = DEFINITION.match(line)
+            if match and match.group('name') not in NOT_FUNCTIONS \
+                    and not match.group('head').startswith(NOT_TYPES):
+                head = ' '.join(match.group('head').split()) + ' '
+                args = strip_defaults(match.group('args'))
+                yield line_number, '%s%s(%s);' % (head, match.group('name'), args)
+        code = strip_code(line)
+        depth += code.count('{') - code.count('}')
+        line_number += 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--cxx', default='c++', help='compiler used to preprocess')
+    parser.add_argument('--output', required=True)
+    parser.add_argument('source')
+    parser.add_argument('flags', nargs='*', help='preprocessor flags, after --')
+    options = parser.parse_args()
+
+    definitions = list(find_definitions(preprocess(options.cxx, options.flags, options.source),
+                                        options.source))
+    if not definitions:
+        sys.exit('%s: no function definitions found' % options.source)
+    first_line = min(line for line, _ in definitions)
+    prototypes = []
+    for _, prototype in definitions:
+        if prototype not in prototypes:
+            prototypes.append(prototype)
+
+    with open(options.source) as sketch:
+        lines = sketch.read().split('\n')
+    source = os.path.abspath(options.source).replace('\\', '/')
+    output = ['#line 1 "%s"' % source] + lines[:first_line - 1] \
+        + prototypes + ['#line %d "%s"' % (first_line, source)] + lines[first_line - 1:]
+    with open(options.output, 'w') as sketch:
+        sketch.write('\n'.join(output))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,149 @@
+// Arduino core and AVR library shims for the HAL_HOST build of backedcode.c.
+// The simulator (sim.cpp) provides the hal*() functions and the gsm / console
+// streams; this header only covers what the control logic uses directly.
+#pragma once
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// --- PINS ---
+// Only the numbers the pin table and static_asserts refer to; sim.cpp models
+// the devices, not the pins.
+#define HIGH 1
+#define LOW 0
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : NOT_AN_INTERRUPT))
+
+// --- PROGMEM ---
+// Flash and RAM are one address space here, so the _P functions are the plain ones
+// and a PSTR() argument is printed with an ordinary %s. (glibc reads %S as a
+// wide string.)
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define PRI_PSTR "%s"
+// Copied out rather than dereferenced: the sketch reads words out of structs and
+// enums with these, which a cast would do behind the optimizer's back.
+inline uint8_t pgm_read_byte(const void* p) { uint8_t v; memcpy(&v, p, sizeof(v)); return v; }
+inline uint16_t pgm_read_word(const void* p) { uint16_t v; memcpy(&v, p, sizeof(v)); return v; }
+inline uint32_t pgm_read_dword(const void* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+inline void* pgm_read_ptr(const void* p) { void* v; memcpy(&v, p, sizeof(v)); return v; }
+#define memcpy_P memcpy
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strcasecmp_P strcasecmp
+#define strncasecmp_P strncasecmp
+#define strstr_P strstr
+#define snprintf_P snprintf
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper*)(s))
+
+// --- BOARD ATTRIBUTES ---
+#define HAL_ISR_ATTR
+#define HAL_NOINIT                  // The simulator never resets the process
+#define E2END 1023                  // Same EEPROM layout as the Uno
+#define SERIAL_TX_BUFFER_SIZE 64
+
+// The simulator runs "interrupts" between loop() passes, never inside one
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_BLOCK(type) for (bool atomicOnce = true; atomicOnce; atomicOnce = false)
+
+// --- ARDUINO CORE ---
+// The AVR core's macros, with their integer promotions
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define bit(b) (1UL << (b))
+
+inline long map(long x, long inMin, long inMax, long outMin, long outMax) {
+    return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+// avr-libc's number formatting
+inline char* dtostrf(double value, signed char width, unsigned char precision, char* text) {
+    sprintf(text, "%*.*f", width, precision, value);
+    return text;
+}
+
+inline char* itoa(int value, char* text, int base) {
+    sprintf(text, base == 16 ? "%x" : "%d", value);
+    return text;
+}
+
+// avr-libc's CRC-16 (polynomial 0xA001), as used for the config block
+inline uint16_t _crc16_update(uint16_t crc, uint8_t data) {
+    crc ^= data;
+    for (byte i = 0; i < 8; i++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    return crc;
+}
+
+#define DEC 10
+#define HEX 16
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual int availableForWrite() { return SERIAL_TX_BUFFER_SIZE; }
+    virtual void flush() {}
+
+    size_t write(const uint8_t* buffer, size_t size) {
+        for (size_t i = 0; i < size; i++) write(buffer[i]);
+        return size;
+    }
+    size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+
+    size_t print(const __FlashStringHelper* s) { return write((const char*)s); }
+    size_t print(const char* s) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(long n, int base = DEC) {
+        char text[24];
+        snprintf(text, sizeof(text), base == HEX ? "%lX" : "%ld", n);
+        return write(text);
+    }
+    size_t print(unsigned long n, int base = DEC) {
+        char text[24];
+        snprintf(text, sizeof(text), base == HEX ? "%lX" : "%lu", n);
+        return write(text);
+    }
+    size_t print(double n, int digits = 2) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.*f", digits, n);
+        return write(text);
+    }
+
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(T value) { return print(value) + println(); }
+    template <typename T> size_t println(T value, int format) { return print(value, format) + println(); }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
@@ -0,0 +1,113 @@
+// Replays one sensor trace through the sketch and reports the benchmarks:
+//
+//     replay [--log] [--check] [--csv] [--slowdown N] trace
+//
+//   --log         Print the console output and modem traffic with time stamps
+//   --check       Exit with 1 if an expectation of the trace is not met
+//   --csv         One line of figures instead of the report, for comparing runs
+//   --slowdown N  Simulated time per host time spent in loop() (default 50);
+//                 0 makes a replay deterministic
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "sim.h"
+
+template <typename T> T percentile(std::vector<T> values, double share) {
+    if (values.empty()) return 0;
+    size_t index = (size_t)(share * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+template <typename T> double mean(const std::vector<T>& values) {
+    if (values.empty()) return 0;
+    double sum = 0;
+    for (T value : values) sum += value;
+    return sum / values.size();
+}
+
+template <typename T> T largest(const std::vector<T>& values) {
+    return values.empty() ? 0 : *std::max_element(values.begin(), values.end());
+}
+
+int usage() {
+    fprintf(stderr, "usage: replay [--log] [--check] [--csv] [--slowdown N] trace\n");
+    return 2;
+}
+
+void printReport(const Trace& trace, const SimResult& result) {
+    double cyclesPerPass = result.passTimes.empty() ? 0 : (double)result.passCycles / result.passTimes.size();
+    printf("trace          %s\n", trace.name.c_str());
+    printf("simulated      %.1f s in %.2f s (%.0fx real time)\n", result.simulatedMs / 1000.0, result.hostSeconds,
+           result.hostSeconds > 0 ? result.simulatedMs / 1000.0 / result.hostSeconds : 0);
+    if (result.alertLatencies.empty()) {
+        printf("alert latency  no alerts expected\n");
+    } else {
+        printf("alert latency  min %ld ms, mean %.0f ms, max %ld ms over %zu alerts\n",
+               *std::min_element(result.alertLatencies.begin(), result.alertLatencies.end()),
+               mean(result.alertLatencies), largest(result.alertLatencies), result.alertLatencies.size());
+    }
+    printf("sms            %lu sent, %lu calls\n", result.smsSent, result.callsPlaced);
+    if (result.framesPublished > 0) printf("telemetry      %lu frames published\n", result.framesPublished);
+    printf("loop jitter    task start past deadline: p50 %u us, p99 %u us, max %u us over %zu runs\n",
+           percentile(result.taskLateness, 0.5), percentile(result.taskLateness, 0.99),
+           largest(result.taskLateness), result.taskLateness.size());
+    printf("cpu/iteration  mean %.0f ns, p99 %u ns, max %u ns", mean(result.passTimes),
+           percentile(result.passTimes, 0.99), largest(result.passTimes));
+    if (result.passCycles > 0) printf(", %.0f cycles", cyclesPerPass);
+    printf(" over %zu loop() passes\n", result.passTimes.size());
+    printf("expectations   %d checked, %zu failed\n", result.expectations, result.failures.size());
+}
+
+void printCsv(const Trace& trace, const SimResult& result) {
+    printf("%s,%ld,%.0f,%lu,%lu,%u,%u,%.0f,%u,%zu\n", trace.name.c_str(),
+           largest(result.alertLatencies), mean(result.alertLatencies), result.smsSent, result.callsPlaced,
+           percentile(result.taskLateness, 0.99), largest(result.taskLateness),
+           mean(result.passTimes), percentile(result.passTimes, 0.99), result.failures.size());
+}
+
+int main(int argc, char** argv) {
+    SimOptions options = SimOptions();
+    options.slowdown = SIM_DEFAULT_SLOWDOWN;
+    bool check = false, csv = false;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--log") == 0) {
+            options.log = true;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            check = true;
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        } else if (strcmp(argv[i], "--slowdown") == 0 && i + 1 < argc) {
+            char* end;
+            options.slowdown = strtod(argv[++i], &end);
+            if (*end != '\0' || options.slowdown < 0) return usage();
+        } else if (argv[i][0] == '-' || path != NULL) {
+            return usage();
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL) return usage();
+
+    Trace trace;
+    std::string error;
+    if (!loadTrace(path, trace, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 2;
+    }
+
+    SimResult result;
+    runTrace(trace, options, result);
+    if (csv) {
+        printCsv(trace, result);
+    } else {
+        printReport(trace, result);
+    }
+    for (const std::string& failure : result.failures) fprintf(stderr, "%s\n", failure.c_str());
+    return check && !result.failures.empty() ? 1 : 0;
+}
@@ -0,0 +1,710 @@
+// The simulated board: hal*() for backedcode.c, a SIM800-style modem, a DHT11
+// and the trace player. The sketch is compiled into this file so the player can
+// see its scheduler table.
+#include "sim.h"
+
+#include <time.h>
+
+#include <chrono>
+#include <deque>
+#include <map>
+
+#include "sketch.cpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define readCycles() __rdtsc()
+#else
+#define readCycles() 0ULL           // Only host time is measured
+#endif
+
+#define MODEM_REPLY_DELAY 20        // ms from a command to its result code
+#define MODEM_PROMPT_DELAY 100      // ms from AT+CMGS to the '>' prompt
+#define MODEM_SEND_DELAY 2000       // ms from Ctrl+Z to +CMGS: the network round trip
+#define MODEM_TCP_DELAY 300         // ms from AT+CIPSTART to CONNECT OK, and from the data to SEND OK
+#define DHT_RESPONSE_DELAY 30       // us from the line being released to the first edge
+#define NS_PER_MS 1000000ULL
+
+// --- SIMULATED CLOCK ---
+uint64_t simNow = 0;                // ns since power-on
+uint64_t simNextTick = NS_PER_MS;   // Next timer and ADC interrupt
+bool simIdle = false;               // The last pass found nothing due
+bool simInPass = false;             // loop() is running: host time since simPassStart counts too
+uint64_t simPassStart = 0;          // simCpuTime() when the pass began
+const SimOptions* simOptions;
+SimResult* simResult;
+
+struct SimReset {};                 // Thrown by halReset(): the replay stops there
+
+// CPU time of this thread, so a pass is not charged for the host preempting it
+uint64_t simCpuTime() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint64_t simCpuTimeCost = 0;        // What reading simCpuTime() itself takes
+
+void simCalibrate() {
+    simCpuTimeCost = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t start = simCpuTime();
+        uint64_t cost = simCpuTime() - start;
+        if (cost < simCpuTimeCost) simCpuTimeCost = cost;
+    }
+}
+
+void simPrefix(FILE* out) {
+    fprintf(out, "[%9.3f] ", simNow / 1e9);
+}
+
+// --- DEVICES ---
+bool simSound = false;              // Level from "sound" events
+unsigned long simCryStart = 0, simCryEnd = 0;
+long simCryOn = 1, simCryOff = 0;
+int simSoil = 1023;                 // Dry probe until the trace says otherwise
+bool simAdcRunning = false;
+byte simFanDuty = 0;
+bool simBuzzer = false;
+byte simServo = 0;
+char simLcd[LCD_ROWS][LCD_COLS];
+byte simLcdCol = 0, simLcdRow = 0;
+byte simEeprom[E2END + 1];
+
+bool simDhtPresent = false;
+float simDhtTemperature = 0, simDhtHumidity = 0;
+std::deque<uint64_t> simDhtEdges;   // ns time stamps of the falling edges still to come
+
+bool simSoundNow() {
+    unsigned long now = simNow / NS_PER_MS;
+    if (now >= simCryStart && now < simCryEnd) return (now - simCryStart) % (simCryOn + simCryOff) < (unsigned long)simCryOn;
+    return simSound;
+}
+
+// The 40 data bits a DHT11 sends for these values: one falling edge to start
+// the response, one to start the data, then one closing each bit
+void simScheduleDhtEdges() {
+    byte data[5];
+    int humidityTenths = lround(simDhtHumidity * 10);
+    data[0] = humidityTenths / 10;
+    data[1] = humidityTenths % 10;
+    int tenths = lround(fabs(simDhtTemperature) * 10);
+    if (simDhtTemperature >= 0) {
+        data[2] = tenths / 10;
+        data[3] = tenths % 10;
+    } else {
+        data[2] = (tenths + 9) / 10 - 1;   // Read back as -1 - data[2] + data[3] / 10
+        data[3] = 0x80 | ((data[2] + 1) * 10 - tenths);
+    }
+    data[4] = data[0] + data[1] + data[2] + data[3];
+
+    uint64_t edge = simNow + DHT_RESPONSE_DELAY * 1000;
+    simDhtEdges.clear();
+    simDhtEdges.push_back(edge);
+    edge += 160000;                        // 80 us low, 80 us high
+    simDhtEdges.push_back(edge);
+    for (int i = 0; i < 40; i++) {
+        bool one = data[i / 8] & (0x80 >> (i % 8));
+        edge += one ? 120000 : 77000;      // 50 us low, then 70 or 27 us high
+        simDhtEdges.push_back(edge);
+    }
+}
+
+// --- MODEM ---
+// Answers the AT commands the sketch sends, echoing them as a modem does, and
+// keeps the SMS storage. The telemetry uplink gets a broker that accepts every
+// packet. Bytes become readable at the time they are "sent".
+struct SimSms {
+    unsigned long time;     // ms when the sketch issued AT+CMGS
+    std::string number;
+    std::string text;
+    uint64_t confirmTime;   // ns when +CMGS goes back: switched off before, it was never sent
+};
+
+struct SimOutbound {
+    unsigned long time;     // ms when the SMS or call was started; only SMS that went out count
+    bool call;
+};
+
+class SimModem : public Stream {
+public:
+    bool on = true;
+    bool refuse = false;    // Answer every SMS with +CMS ERROR
+    std::vector<SimSms> sent;
+    std::vector<SimOutbound> outbound;
+
+    int available() override {
+        int count = 0;
+        for (const auto& entry : rx) {
+            if (entry.first > simNow) break;
+            count++;
+        }
+        return count;
+    }
+
+    int read() override {
+        if (available() == 0) return -1;
+        int c = (unsigned char)rx.front().second;
+        rx.pop_front();
+        return c;
+    }
+
+    int peek() override {
+        return available() > 0 ? (unsigned char)rx.front().second : -1;
+    }
+
+    size_t write(uint8_t c) override {
+        if (!on) return 1;
+        if (c == '\n' && lastChar == '\r' && data.empty()) {
+            lastChar = c; // Second half of a println(): the command already ran on the '\r'
+            return 1;
+        }
+        if (dataLeft > 0) {
+            lastChar = c;
+            if (c == 27 && data.empty()) {  // ESC before any data aborts the AT+CIPSEND
+                dataLeft = 0;
+            } else {
+                data += (char)c;            // Binary: only the announced length ends it
+                if (--dataLeft == 0) endData();
+            }
+            return 1;
+        }
+        if (inBody) {
+            lastChar = c;
+            if (c == 26) {          // Ctrl+Z
+                inBody = false;
+                endSms();
+            } else if (c == 27) {   // ESC
+                inBody = false;
+                reply(MODEM_REPLY_DELAY, "\r\nOK\r\n");
+            } else {
+                body += (char)c;
+            }
+            return 1;
+        }
+        if (c == '\r' || c == '\n') {
+            if (!command.empty()) {
+                reply(0, command + "\r");
+                runCommand(command);
+                command.clear();
+            }
+        } else {
+            command += (char)c;
+        }
+        lastChar = c;
+        return 1;
+    }
+
+    void setMode(long mode) {
+        refuse = mode == TRACE_MODEM_REFUSE;
+        if (mode != TRACE_MODEM_OFF) {
+            on = true;
+            return;
+        }
+        // Power gone: nothing pending comes out, and an SMS not yet confirmed is lost
+        on = false;
+        rx.clear();
+        command.clear();
+        inBody = false;
+        dataLeft = 0;
+        data.clear();
+        notify = false;
+        tcpOpen = false;
+        lastChar = 0;
+        for (size_t i = sent.size(); i-- > 0;) {
+            if (sent[i].confirmTime <= simNow) break;
+            for (size_t j = outbound.size(); j-- > 0;) {
+                if (!outbound[j].call && outbound[j].time == sent[i].time) {
+                    outbound.erase(outbound.begin() + j);
+                    break;
+                }
+            }
+            sent.erase(sent.begin() + i);
+            simResult->smsSent--;
+        }
+    }
+
+    // Stores an inbound SMS and announces it
+    void receive(const std::string& sender, const std::string& text) {
+        if (!on) return;
+        int slot = 1;
+        while (inbox.count(slot)) slot++;
+        inbox[slot] = std::make_pair(sender, text);
+        if (notify) reply(0, "\r\n+CMTI: \"SM\"," + std::to_string(slot) + "\r\n");
+    }
+
+private:
+    std::deque<std::pair<uint64_t, char>> rx;
+    std::string command;
+    char lastChar = 0;
+    bool inBody = false;
+    std::string body;
+    std::string number;
+    unsigned long bodyTime = 0;
+    int messageReference = 0;
+    bool notify = false;    // AT+CNMI since power-on: without it an SMS is only stored
+    bool tcpOpen = false;
+    int dataLeft = 0;       // Bytes still to come after AT+CIPSEND
+    std::string data;
+    std::map<int, std::pair<std::string, std::string>> inbox; // Slot to sender and text
+
+    void reply(unsigned long delay, const std::string& text) {
+        uint64_t time = simNow + delay * NS_PER_MS;
+        if (!rx.empty() && rx.back().first > time) time = rx.back().first; // Keep the order
+        for (char c : text) rx.push_back(std::make_pair(time, c));
+    }
+
+    static bool startsWith(const std::string& text, const char* prefix) {
+        return text.compare(0, strlen(prefix), prefix) == 0;
+    }
+
+    void runCommand(const std::string& line) {
+        unsigned long now = simNow / NS_PER_MS;
+        if (startsWith(line, "AT+CMGS=")) {
+            size_t start = line.find('"') + 1;
+            number = line.substr(start, line.find('"', start) - start);
+            body.clear();
+            bodyTime = now;
+            inBody = true;
+            reply(MODEM_PROMPT_DELAY, "\r\n> ");
+        } else if (startsWith(line, "ATD")) {
+            outbound.push_back({now, true});
+            simResult->callsPlaced++;
+            if (simOptions->log) {
+                simPrefix(stdout);
+                printf("modem: call to %s\n", line.substr(3, line.size() - 4).c_str());
+            }
+            reply(MODEM_REPLY_DELAY, "\r\nOK\r\n");
+        } else if (startsWith(line, "AT+CMGR=")) {
+            auto message = inbox.find(atoi(line.c_str() + 8));
+            if (message == inbox.end()) {
+                reply(MODEM_REPLY_DELAY, "\r\nOK\r\n");
+            } else {
+                reply(MODEM_REPLY_DELAY, "\r\n+CMGR: \"REC UNREAD\",\"" + message->second.first
+                      + "\",\"\",\"26/01/01,00:00:00+00\"\r\n" + message->second.second + "\r\n\r\nOK\r\n");
+            }
+        } else if (line == "AT+CMGD=1,4") {
+            inbox.clear();
+            reply(MODEM_REPLY_DELAY, "\r\nOK\r\n");
+        } else if (startsWith(line, "AT+CMGD=")) {
+            inbox.erase(atoi(line.c_str() + 8));
+            reply(MODEM_REPLY_DELAY, "\r\nOK\r\n");
+        } else if (startsWith(line, "AT+CNMI=")) {
+            notify = true;
+            reply(MODEM_REPLY_DELAY, "\r\nOK\r\n");
+        } else if (line == "AT+CIPSHUT") {
+            tcpOpen = false;
+            reply(MODEM_REPLY_DELAY, "\r\nSHUT OK\r\n");
+        } else if (line == "AT+CIFSR") {
+            reply(MODEM_REPLY_DELAY, "\r\n10.64.0.2\r\n"); // The local IP, and no OK
+        } else if (startsWith(line, "AT+CIPSTART=")) {
+            tcpOpen = true;
+            reply(MODEM_REPLY_DELAY, "\r\nOK\r\n");
+            reply(MODEM_TCP_DELAY, "\r\nCONNECT OK\r\n");
+        } else if (startsWith(line, "AT+CIPSEND=")) {
+            if (!tcpOpen) {
+                reply(MODEM_REPLY_DELAY, "\r\nERROR\r\n");
+                return;
+            }
+            dataLeft = atoi(line.c_str() + 11);
+            reply(MODEM_PROMPT_DELAY, "\r\n> ");
+        } else if (startsWith(line, "AT")) {
+            // AT, ATH, AT+CMGF, AT+IPR, AT+CIPRXGET, AT+CSTT, AT+CIICR
+            reply(MODEM_REPLY_DELAY, "\r\nOK\r\n");
+        }
+    }
+
+    void endSms() {
+        if (simOptions->log) {
+            simPrefix(stdout);
+            printf("modem: SMS to %s%s: %s\n", number.c_str(), refuse ? " refused" : "", body.c_str());
+        }
+        if (refuse) {
+            reply(MODEM_SEND_DELAY, "\r\n+CMS ERROR: 500\r\n");
+            return;
+        }
+        sent.push_back({bodyTime, number, body, simNow + MODEM_SEND_DELAY * NS_PER_MS});
+        outbound.push_back({bodyTime, false});
+        simResult->smsSent++;
+        reply(MODEM_SEND_DELAY, "\r\n+CMGS: " + std::to_string(++messageReference) + "\r\n\r\nOK\r\n");
+    }
+
+    // An MQTT packet per AT+CIPSEND: the upper nibble of its first byte is the type
+    void endData() {
+        bool publish = ((unsigned char)data[0] >> 4) == 3;
+        if (publish) simResult->framesPublished++;
+        if (simOptions->log) {
+            simPrefix(stdout);
+            printf("modem: MQTT %s, %zu bytes\n", publish ? "PUBLISH" : "CONNECT", data.size());
+        }
+        data.clear();
+        reply(MODEM_TCP_DELAY, "\r\nSEND OK\r\n");
+    }
+};
+
+// Serial console: lines typed from the trace, output printed with --log
+class SimConsole : public Stream {
+public:
+    std::string input;
+
+    int available() override { return input.size(); }
+    int read() override {
+        if (input.empty()) return -1;
+        int c = (unsigned char)input[0];
+        input.erase(0, 1);
+        return c;
+    }
+    int peek() override { return input.empty() ? -1 : (unsigned char)input[0]; }
+
+    size_t write(uint8_t c) override {
+        if (c == '\n') {
+            if (simOptions->log) {
+                simPrefix(stdout);
+                printf("%s\n", line.c_str());
+            }
+            line.clear();
+        } else if (c != '\r') {
+            line += (char)c;
+        }
+        return 1;
+    }
+
+private:
+    std::string line;
+};
+
+SimModem simModem;
+SimConsole simConsole;
+Stream& gsmPort = simModem;
+Stream& console = simConsole;
+
+// --- HAL ---
+unsigned long halMillis() {
+    return simNow / NS_PER_MS;
+}
+
+// With ENABLE_PROFILING the clock runs on within a pass by the host time spent
+// so far, so the sketch's own task timing sees that work. Reading the host
+// clock is a system call, so the plain build, which is measured from outside,
+// keeps the clock still until the pass is over.
+unsigned long halMicros() {
+    uint64_t now = simNow;
+#if ENABLE_PROFILING
+    if (simInPass && simOptions->slowdown > 0) {
+        now += (uint64_t)((simCpuTime() - simPassStart) * simOptions->slowdown);
+    }
+#endif
+    return now / 1000;
+}
+
+void halStartSerial(unsigned long gsmBaud) {}
+void halGsmBegin(unsigned long baud) {}  // The simulated modem follows any rate
+
+void halStartPins() {
+    simFanDuty = 0;
+    simBuzzer = false;
+}
+
+bool halSoundActive() {
+    return simSoundNow();
+}
+
+void halSetBuzzer(bool on) {
+    simBuzzer = on;
+}
+
+void halToggleBuzzer() {
+    simBuzzer = !simBuzzer;
+}
+
+void halWriteFan(byte duty) {
+    simFanDuty = duty;
+}
+
+void halServoAttach(byte degrees) {
+    simServo = degrees;
+}
+
+void halServoWrite(byte degrees) {
+    simServo = degrees;
+}
+
+void halLcdBegin() {
+    memset(simLcd, ' ', sizeof(simLcd));
+}
+
+void halLcdBacklight(bool on) {}
+
+void halLcdSetCursor(byte col, byte row) {
+    simLcdCol = col;
+    simLcdRow = row;
+}
+
+void halLcdWrite(char c) {
+    if (simLcdRow < LCD_ROWS && simLcdCol < LCD_COLS) simLcd[simLcdRow][simLcdCol++] = c;
+}
+
+bool halLcdTimedOut() {
+    return false;
+}
+
+void halLcdRecover() {}
+
+void halStartStorage() {
+    memset(simEeprom, 0xFF, sizeof(simEeprom)); // Erased: the sketch starts from its defaults
+}
+
+bool halEepromReady() {
+    return true;
+}
+
+byte halEepromRead(int address) {
+    return simEeprom[address];
+}
+
+void halEepromWrite(int address, byte value) {
+    simEeprom[address] = value;
+}
+
+void halEepromCommit() {}
+
+void halIdle() {
+    simIdle = true;
+}
+
+void halPowerDownUnused() {}
+void halStartTick() {}
+
+void halStartSoilADC() {
+    simAdcRunning = true;
+}
+
+void halDhtStart() {
+    simDhtEdges.clear();
+}
+
+void halDhtListen() {
+    if (simDhtPresent) simScheduleDhtEdges();
+}
+
+void halDhtStop() {
+    simDhtEdges.clear();
+}
+
+ResetCause halResetCause() {
+    return RESET_POWER_ON;
+}
+
+void halWatchdogStart() {}
+void halWatchdogFeed() {}
+
+void halReset() {
+    throw SimReset();
+}
+
+#if ENABLE_PROFILING
+// There is no SRAM budget on the host; the report shows 0 for both figures
+void halPaintFreeSRAM() {}
+
+int halFreeSRAM() {
+    return 0;
+}
+
+int halFreeSRAMLowWater() {
+    return 0;
+}
+#endif
+
+// --- INTERRUPTS ---
+// Runs every interrupt due by `until` at its own time stamp, in time order
+void simRunInterrupts(uint64_t until) {
+    uint64_t passEnd = simNow;
+    for (;;) {
+        uint64_t edge = simDhtEdges.empty() ? UINT64_MAX : simDhtEdges.front();
+        if (simNextTick > until && edge > until) break;
+        if (edge < simNextTick) {
+            simNow = edge;
+            simDhtEdges.pop_front();
+            dhtEdgeISR();
+        } else {
+            simNow = simNextTick;
+            simNextTick += NS_PER_MS;
+            timerTick();
+            if (simAdcRunning) addSoilReading(simSoil);
+        }
+    }
+    simNow = until > passEnd ? until : passEnd;
+}
+
+// --- TRACE PLAYER ---
+void simFail(const Trace& trace, const TraceEvent& event, const std::string& what) {
+    simResult->failures.push_back(trace.name + ":" + std::to_string(event.line) + ": " + what);
+}
+
+void simApply(const Trace& trace, const TraceEvent& event) {
+    switch (event.type) {
+        case TRACE_SOUND:
+            simSound = event.value != 0;
+            break;
+        case TRACE_CRY:
+            simCryStart = event.time;
+            simCryEnd = event.time + event.value;
+            simCryOn = event.on;
+            simCryOff = event.off;
+            break;
+        case TRACE_SOIL:
+            simSoil = event.value;
+            break;
+        case TRACE_DHT:
+            simDhtPresent = true;
+            simDhtTemperature = event.temperature;
+            simDhtHumidity = event.humidity;
+            break;
+        case TRACE_DHT_OFF:
+            simDhtPresent = false;
+            break;
+        case TRACE_MODEM:
+            simModem.setMode(event.value);
+            break;
+        case TRACE_SMS:
+            simModem.receive(event.sender.empty() ? std::string(config.phoneNumbers[0]) : event.sender, event.text);
+            break;
+        case TRACE_CONSOLE:
+            simConsole.input += event.text + "\n";
+            break;
+        case TRACE_EXPECT_FAN:
+            simResult->expectations++;
+            if ((simFanDuty != 0) != (event.value != 0)) {
+                simFail(trace, event, event.value ? "fan is off" : "fan is on");
+            }
+            break;
+        default:
+            break;  // The other expectations are checked once the replay is over
+    }
+}
+
+// Outbound SMS and calls against the trace's expectations
+void simCheck(const Trace& trace) {
+    const std::vector<SimOutbound>& outbound = simModem.outbound;
+    for (const TraceEvent& event : trace.events) {
+        switch (event.type) {
+            case TRACE_EXPECT_ALERT: {
+                simResult->expectations++;
+                long latency = -1;
+                for (const SimOutbound& start : outbound) {
+                    if (start.time >= event.time) {
+                        latency = start.time - event.time;
+                        break;
+                    }
+                }
+                if (latency >= 0) simResult->alertLatencies.push_back(latency);
+                if (latency < 0 || latency > event.value) {
+                    simFail(trace, event, latency < 0 ? "no alert was sent"
+                                                      : "alert came after " + std::to_string(latency) + " ms");
+                }
+                break;
+            }
+            case TRACE_EXPECT_QUIET:
+                simResult->expectations++;
+                for (const SimOutbound& start : outbound) {
+                    if (start.time >= event.time && start.time < event.time + event.value) {
+                        simFail(trace, event, std::string(start.call ? "call" : "SMS") + " at "
+                                + std::to_string(start.time) + " ms");
+                        break;
+                    }
+                }
+                break;
+            case TRACE_EXPECT_TEXT: {
+                simResult->expectations++;
+                bool found = false;
+                for (const SimSms& sms : simModem.sent) {
+                    if (sms.time >= event.time && sms.text.find(event.text) != std::string::npos) found = true;
+                }
+                if (!found) simFail(trace, event, "no SMS contains \"" + event.text + "\"");
+                break;
+            }
+            case TRACE_EXPECT_SMS:
+                simResult->expectations++;
+                if (simResult->smsSent != (unsigned long)event.value) {
+                    simFail(trace, event, std::to_string(simResult->smsSent) + " SMS sent");
+                }
+                break;
+            case TRACE_EXPECT_PUBLISH:
+                simResult->expectations++;
+                if (simResult->framesPublished != (unsigned long)event.value) {
+                    simFail(trace, event, std::to_string(simResult->framesPublished) + " frames published");
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// One loop() pass: its host cost moves the clock, and each task it ran is
+// charged the time it started past its deadline
+void simPass() {
+    unsigned long deadlines[TASK_COUNT];
+    for (int id = 0; id < TASK_COUNT; id++) deadlines[id] = tasks[id].nextRun;
+    uint64_t start = simNow;
+
+    simIdle = false;
+    uint64_t hostStart = simCpuTime();
+    uint64_t cyclesStart = readCycles();
+    simPassStart = hostStart;
+    simInPass = true;
+    loop();
+    simInPass = false;
+    uint64_t cycles = readCycles() - cyclesStart;
+    uint64_t hostNs = simCpuTime() - hostStart;
+    hostNs = hostNs > simCpuTimeCost ? hostNs - simCpuTimeCost : 0;
+
+    simResult->passTimes.push_back(hostNs > UINT32_MAX ? UINT32_MAX : hostNs);
+    simResult->passCycles += cycles;
+    for (int id = 0; id < TASK_COUNT; id++) {
+        if (tasks[id].nextRun == deadlines[id]) continue;
+        uint64_t deadline = (uint64_t)deadlines[id] * NS_PER_MS;
+        simResult->taskLateness.push_back(start > deadline ? (start - deadline) / 1000 : 0);
+    }
+    simNow += (uint64_t)(hostNs * simOptions->slowdown);
+}
+
+void runTrace(const Trace& trace, const SimOptions& options, SimResult& result) {
+    result = SimResult();
+    simOptions = &options;
+    simResult = &result;
+    uint64_t endTime = (uint64_t)trace.endTime * NS_PER_MS;
+    size_t next = 0;
+
+    simCalibrate();
+    auto hostStart = std::chrono::steady_clock::now();
+    try {
+        while (next < trace.events.size() && trace.events[next].time == 0) simApply(trace, trace.events[next++]);
+        setup();
+        while (simNow < endTime) {
+            while (next < trace.events.size() && trace.events[next].time * NS_PER_MS <= simNow) {
+                simApply(trace, trace.events[next++]);
+            }
+            simPass();
+            uint64_t wake = simNow;
+            if (simIdle) {
+                // Sleep until the next interrupt, as the CPU does
+                wake = simNextTick;
+                if (!simDhtEdges.empty() && simDhtEdges.front() < wake) wake = simDhtEdges.front();
+            }
+            simRunInterrupts(wake);
+        }
+    } catch (const SimReset&) {
+        result.reset = true;
+        result.failures.push_back(trace.name + ": the sketch reset itself, last reset cause "
+                                  + std::to_string(resetReport.cause));
+    }
+    result.hostSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - hostStart).count();
+    result.simulatedMs = halMillis();
+    simCheck(trace);
+}
@@ -0,0 +1,41 @@
+// Replays a trace through the sketch on a simulated clock.
+//
+// Time only moves when the sketch lets it: each loop() pass advances the clock
+// by the host time it took, times the slowdown, and an idle pass (halIdle())
+// skips straight to the next interrupt. The 1 ms tick, the soil ADC and the DHT
+// edges are delivered between passes, each at its own time stamp. A replay runs
+// as fast as the host can execute the passes.
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+struct SimOptions {
+    double slowdown;    // Simulated time per host time spent in loop(); 0 = passes take no time
+    bool log;           // Print console output and modem traffic as it happens
+};
+
+#define SIM_DEFAULT_SLOWDOWN 50     // About a 16 MHz AVR against one desktop core
+
+struct SimResult {
+    std::vector<std::string> failures;     // Unmet expectations, "trace:line: what"
+    int expectations;
+    std::vector<long> alertLatencies;      // ms from each "expect alert" to the SMS or call starting
+    unsigned long smsSent;
+    unsigned long callsPlaced;
+    unsigned long framesPublished;         // MQTT PUBLISH packets sent to the broker
+    std::vector<uint32_t> taskLateness;    // us past its deadline, one per task run
+    std::vector<uint32_t> passTimes;       // Host ns per loop() pass
+    uint64_t passCycles;                   // Host cycles over all passes, 0 where not counted
+    unsigned long simulatedMs;
+    double hostSeconds;
+    bool reset;                            // The sketch reset itself; the replay stopped there
+};
+
+// Runs the trace from power-on. The sketch keeps its globals, so a process can
+// replay only one trace.
+void runTrace(const Trace& trace, const SimOptions& options, SimResult& result);
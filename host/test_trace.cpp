@@ -0,0 +1,112 @@
+// Checks the trace parser: times and their units, each event's arguments, the
+// end of a replay, and that malformed lines are refused with their line number.
+#include <stdio.h>
+
+#include <string>
+
+#include "trace.h"
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static bool parse(const char* text, Trace& trace) {
+    std::string error;
+    return parseTrace("test", text, trace, error);
+}
+
+// The error for a trace that must not parse, or "" if it parsed
+static std::string refusal(const char* text) {
+    Trace trace;
+    std::string error;
+    return parseTrace("test", text, trace, error) ? std::string() : error;
+}
+
+static void testTimes() {
+    Trace trace;
+    CHECK(parse("1500 sound 1\n1.5s sound 0\n90s sound 1\n2min sound 0\n2.5min sound 1\n", trace));
+    CHECK(trace.events.size() == 5);
+    CHECK(trace.events[0].time == 1500);
+    CHECK(trace.events[1].time == 1500);
+    CHECK(trace.events[2].time == 90000);
+    CHECK(trace.events[3].time == 120000);
+    CHECK(trace.events[4].time == 150000);
+    CHECK(refusal("10h sound 1\n") == "test:1: line does not start with a time");
+    CHECK(refusal("soon sound 1\n") == "test:1: line does not start with a time");
+}
+
+static void testEvents() {
+    Trace trace;
+    CHECK(parse("# comment\n"
+                "\n"
+                "0 soil 820\n"
+                "0 dht -2.5 40\n"
+                "1s dht off\n"
+                "2s cry 20s\n"
+                "2s cry 5s 100 50\n"
+                "3s modem off\n"
+                "4s sms STATUS\n"
+                "5s sms +15550100 fan on\n"
+                "6s console SET TEMP 28\n"
+                "7s expect alert 1s\n"
+                "8s expect text temp 23.5C 45%\n"
+                "9s expect fan on\n"
+                "10s expect sms 2\n"
+                "11s expect publish 3\n", trace));
+    CHECK(trace.events.size() == 14);
+    CHECK(trace.events[0].type == TRACE_SOIL && trace.events[0].value == 820 && trace.events[0].line == 3);
+    CHECK(trace.events[1].type == TRACE_DHT && trace.events[1].temperature == -2.5f
+          && trace.events[1].humidity == 40.0f);
+    CHECK(trace.events[2].type == TRACE_DHT_OFF);
+    CHECK(trace.events[3].type == TRACE_CRY && trace.events[3].value == 20000
+          && trace.events[3].on == 60 && trace.events[3].off == 40);
+    CHECK(trace.events[4].on == 100 && trace.events[4].off == 50);
+    CHECK(trace.events[5].type == TRACE_MODEM && trace.events[5].value == TRACE_MODEM_OFF);
+    CHECK(trace.events[6].type == TRACE_SMS && trace.events[6].sender.empty() && trace.events[6].text == "STATUS");
+    CHECK(trace.events[7].sender == "+15550100" && trace.events[7].text == "fan on");
+    CHECK(trace.events[8].type == TRACE_CONSOLE && trace.events[8].text == "SET TEMP 28");
+    CHECK(trace.events[9].type == TRACE_EXPECT_ALERT && trace.events[9].value == 1000);
+    CHECK(trace.events[10].type == TRACE_EXPECT_TEXT && trace.events[10].text == "temp 23.5C 45%");
+    CHECK(trace.events[11].type == TRACE_EXPECT_FAN && trace.events[11].value == 1);
+    CHECK(trace.events[12].type == TRACE_EXPECT_SMS && trace.events[12].value == 2);
+    CHECK(trace.events[13].type == TRACE_EXPECT_PUBLISH && trace.events[13].value == 3);
+}
+
+static void testEnd() {
+    Trace trace;
+    CHECK(parse("0 cry 20s\n5s sound 1\n", trace));
+    CHECK(trace.endTime == 30000); // The cry runs past the last event, then the tail
+    CHECK(parse("0 cry 20s\n8s end\n", trace));
+    CHECK(trace.endTime == 8000);
+    CHECK(refusal("0 end\n1s sound 1\n") == "test:2: event after end");
+}
+
+static void testRefusals() {
+    Trace trace;
+    CHECK(refusal("0 sound\n") == "test:1: sound wants 0 or 1");
+    CHECK(refusal("0 soil 1024\n") == "test:1: soil wants a reading of 0-1023");
+    CHECK(refusal("0 dht 24\n") == "test:1: dht wants a temperature and humidity");
+    CHECK(refusal("0 cry 5s 100\n") == "test:1: cry wants on and off times");
+    CHECK(refusal("0 modem maybe\n") == "test:1: modem wants on, off or refuse");
+    CHECK(parse("0 modem refuse\n", trace) && trace.events[0].value == TRACE_MODEM_REFUSE);
+    CHECK(refusal("0 sms +15550100\n") == "test:1: sms wants a text");
+    CHECK(refusal("0 expect publish\n") == "test:1: expect publish wants a count");
+    CHECK(refusal("0 expect rain\n") == "test:1: unknown expectation");
+    CHECK(refusal("0 soil 800 900\n") == "test:1: too many arguments");
+    CHECK(refusal("0 sound 1\n\n0 beep\n") == "test:3: unknown event");
+    CHECK(refusal("2s sound 1\n1s sound 0\n") == "test:2: events are out of order");
+}
+
+int main() {
+    testTimes();
+    testEvents();
+    testEnd();
+    testRefusals();
+    if (failures > 0) fprintf(stderr, "%d checks failed\n", failures);
+    return failures > 0 ? 1 : 0;
+}
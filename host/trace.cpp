@@ -0,0 +1,212 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <fstream>
+#include <sstream>
+
+#define TRACE_TAIL_TIME 10000       // Replay this long past the last event without an end
+#define CRY_BURST_ON 60             // ms of sound per burst: 3 onsets and 180 ms per 300 ms window
+#define CRY_BURST_OFF 40
+
+// "1500", "1.5s" or "2min" to ms. Returns false if it is not a time.
+static bool parseTime(const std::string& word, long& ms) {
+    char* end;
+    double value = strtod(word.c_str(), &end);
+    if (end == word.c_str() || value < 0) return false;
+    double scale;
+    if (*end == '\0' || strcmp(end, "ms") == 0) {
+        scale = 1;
+    } else if (strcmp(end, "s") == 0) {
+        scale = 1000;
+    } else if (strcmp(end, "min") == 0) {
+        scale = 60000;
+    } else {
+        return false;
+    }
+    ms = (long)(value * scale + 0.5);
+    return true;
+}
+
+static bool parseNumber(const std::string& word, long& number) {
+    char* end;
+    number = strtol(word.c_str(), &end, 10);
+    return end != word.c_str() && *end == '\0';
+}
+
+static bool parseFloat(const std::string& word, float& number) {
+    char* end;
+    number = strtof(word.c_str(), &end);
+    return end != word.c_str() && *end == '\0';
+}
+
+// The rest of the line after the words already read, without leading blanks
+static std::string restOfLine(std::istringstream& words) {
+    std::string rest;
+    std::getline(words, rest);
+    size_t start = rest.find_first_not_of(" \t");
+    return start == std::string::npos ? std::string() : rest.substr(start);
+}
+
+static long modemMode(const std::string& word) {
+    if (word == "off") return TRACE_MODEM_OFF;
+    if (word == "on") return TRACE_MODEM_ON;
+    if (word == "refuse") return TRACE_MODEM_REFUSE;
+    return -1;
+}
+
+// Parses the words after the time. Returns an error message, or NULL.
+static const char* parseEvent(std::istringstream& words, TraceEvent& event) {
+    std::string name, argument;
+    words >> name;
+
+    if (name == "sound") {
+        event.type = TRACE_SOUND;
+        if (!(words >> argument) || !parseNumber(argument, event.value)) return "sound wants 0 or 1";
+    } else if (name == "cry") {
+        event.type = TRACE_CRY;
+        event.on = CRY_BURST_ON;
+        event.off = CRY_BURST_OFF;
+        if (!(words >> argument) || !parseTime(argument, event.value)) return "cry wants a duration";
+        if (words >> argument) {
+            if (!parseTime(argument, event.on) || !(words >> argument) || !parseTime(argument, event.off)
+                    || event.on + event.off == 0) {
+                return "cry wants on and off times";
+            }
+        }
+    } else if (name == "soil") {
+        event.type = TRACE_SOIL;
+        if (!(words >> argument) || !parseNumber(argument, event.value) || event.value < 0 || event.value > 1023) {
+            return "soil wants a reading of 0-1023";
+        }
+    } else if (name == "dht") {
+        std::string humidity;
+        if (!(words >> argument)) return "dht wants a temperature and humidity, or off";
+        if (argument == "off") {
+            event.type = TRACE_DHT_OFF;
+        } else {
+            event.type = TRACE_DHT;
+            if (!parseFloat(argument, event.temperature) || !(words >> humidity)
+                    || !parseFloat(humidity, event.humidity)) {
+                return "dht wants a temperature and humidity";
+            }
+        }
+    } else if (name == "modem") {
+        event.type = TRACE_MODEM;
+        if (!(words >> argument) || (event.value = modemMode(argument)) < 0) return "modem wants on, off or refuse";
+    } else if (name == "sms") {
+        event.type = TRACE_SMS;
+        std::string text = restOfLine(words);
+        if (!text.empty() && text[0] == '+') {
+            size_t space = text.find(' ');
+            event.sender = text.substr(0, space);
+            text = space == std::string::npos ? std::string() : text.substr(text.find_first_not_of(' ', space));
+        }
+        if (text.empty()) return "sms wants a text";
+        event.text = text;
+    } else if (name == "console") {
+        event.type = TRACE_CONSOLE;
+        event.text = restOfLine(words);
+        if (event.text.empty()) return "console wants a line";
+    } else if (name == "expect") {
+        if (!(words >> name)) return "expect what?";
+        if (name == "alert" || name == "quiet") {
+            event.type = name == "alert" ? TRACE_EXPECT_ALERT : TRACE_EXPECT_QUIET;
+            if (!(words >> argument) || !parseTime(argument, event.value)) return "expect wants a duration";
+        } else if (name == "text") {
+            event.type = TRACE_EXPECT_TEXT;
+            event.text = restOfLine(words);
+            if (event.text.empty()) return "expect text wants a text";
+        } else if (name == "fan") {
+            event.type = TRACE_EXPECT_FAN;
+            if (!(words >> argument) || (argument != "on" && argument != "off")) return "expect fan wants on or off";
+            event.value = argument == "on";
+        } else if (name == "sms") {
+            event.type = TRACE_EXPECT_SMS;
+            if (!(words >> argument) || !parseNumber(argument, event.value) || event.value < 0) {
+                return "expect sms wants a count";
+            }
+        } else if (name == "publish") {
+            event.type = TRACE_EXPECT_PUBLISH;
+            if (!(words >> argument) || !parseNumber(argument, event.value) || event.value < 0) {
+                return "expect publish wants a count";
+            }
+        } else {
+            return "unknown expectation";
+        }
+    } else if (name == "end") {
+        event.type = TRACE_END;
+    } else {
+        return "unknown event";
+    }
+
+    if (event.type != TRACE_SMS && event.type != TRACE_CONSOLE && event.type != TRACE_EXPECT_TEXT
+            && words >> argument) {
+        return "too many arguments";
+    }
+    return NULL;
+}
+
+bool parseTrace(const std::string& name, const std::string& text, Trace& trace, std::string& error) {
+    trace.name = name;
+    trace.events.clear();
+    trace.endTime = 0;
+
+    std::istringstream lines(text);
+    std::string line;
+    bool ended = false;
+    for (int lineNumber = 1; std::getline(lines, line); lineNumber++) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#') continue;
+        if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+
+        std::istringstream words(line);
+        std::string time;
+        words >> time;
+        TraceEvent event = TraceEvent();
+        event.line = lineNumber;
+        long ms;
+        const char* problem = NULL;
+        if (ended) {
+            problem = "event after end";
+        } else if (!parseTime(time, ms)) {
+            problem = "line does not start with a time";
+        } else if (!trace.events.empty() && (unsigned long)ms < trace.events.back().time) {
+            problem = "events are out of order";
+        } else {
+            event.time = ms;
+            problem = parseEvent(words, event);
+        }
+        if (problem != NULL) {
+            error = name + ":" + std::to_string(lineNumber) + ": " + problem;
+            return false;
+        }
+
+        unsigned long eventEnd = event.time;
+        if (event.type == TRACE_CRY || event.type == TRACE_EXPECT_ALERT || event.type == TRACE_EXPECT_QUIET) {
+            eventEnd += event.value;
+        }
+        if (event.type == TRACE_END) {
+            ended = true;
+            trace.endTime = event.time;
+        } else if (eventEnd > trace.endTime) {
+            trace.endTime = eventEnd;
+        }
+        trace.events.push_back(event);
+    }
+
+    if (!ended) trace.endTime += TRACE_TAIL_TIME;
+    return true;
+}
+
+bool loadTrace(const char* path, Trace& trace, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = std::string(path) + ": cannot open";
+        return false;
+    }
+    std::ostringstream text;
+    text << file.rdbuf();
+    return parseTrace(path, text.str(), trace, error);
+}
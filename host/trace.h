@@ -0,0 +1,61 @@
+// Recorded sensor traces for the host simulator.
+//
+// A trace is a text file of timed events, one per line, in time order:
+//
+//     # Comment
+//     <time> <event> [arguments]
+//
+// <time> is since power-on, in ms unless it ends in s or min ("1500", "90s",
+// "2min"); durations take the same suffixes. Events:
+//
+//     sound 0|1               Sound sensor output (1 = sound)
+//     cry <duration> [on off] Crying: bursts of sound, on/off ms (default 60/40)
+//     soil <0-1023>           Soil probe ADC reading
+//     dht <temp> <humidity>   What the DHT11 answers from now on (degC, %)
+//     dht off                 The DHT11 stops answering
+//     modem on|off            The modem answers AT commands, or goes silent
+//     modem refuse            It answers, but every SMS gets +CMS ERROR
+//     sms [+number] <text>    Inbound SMS, from the configured parent by default
+//     console <line>          Line typed on the serial console
+//     expect alert <within>   A call, or an SMS that goes out, must start within <within>
+//     expect quiet <for>      No SMS or call may start for <for>
+//     expect text <text>      Some SMS sent from now on contains <text>
+//     expect fan on|off       The fan is in this state at this time
+//     expect sms <count>      This many SMS are sent over the whole trace
+//     expect publish <count>  This many telemetry frames reach the broker (ENABLE_TELEMETRY)
+//     end                     Stops the replay (default: 10 s after the last event)
+#pragma once
+
+#include <string>
+#include <vector>
+
+enum TraceEventType {
+    TRACE_SOUND, TRACE_CRY, TRACE_SOIL, TRACE_DHT, TRACE_DHT_OFF, TRACE_MODEM,
+    TRACE_SMS, TRACE_CONSOLE,
+    TRACE_EXPECT_ALERT, TRACE_EXPECT_QUIET, TRACE_EXPECT_TEXT, TRACE_EXPECT_FAN, TRACE_EXPECT_SMS,
+    TRACE_EXPECT_PUBLISH,
+    TRACE_END
+};
+
+enum TraceModemMode { TRACE_MODEM_OFF, TRACE_MODEM_ON, TRACE_MODEM_REFUSE };
+
+struct TraceEvent {
+    unsigned long time;     // ms since power-on
+    TraceEventType type;
+    long value;             // Level, reading, duration, count or TraceModemMode
+    long on, off;           // TRACE_CRY burst pattern, ms
+    float temperature, humidity;
+    std::string text;       // SMS or console text, expected text
+    std::string sender;     // TRACE_SMS; empty for the configured parent
+    int line;               // In the trace file, for messages
+};
+
+struct Trace {
+    std::string name;
+    std::vector<TraceEvent> events;
+    unsigned long endTime;  // ms
+};
+
+// Reads a trace. On failure returns false with error set to "file:line: reason".
+bool loadTrace(const char* path, Trace& trace, std::string& error);
+bool parseTrace(const std::string& name, const std::string& text, Trace& trace, std::string& error);